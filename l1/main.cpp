@@ -9,6 +9,26 @@
 #include <string>
 #include <fstream>
 #include <chrono>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Set by the Makefile from a hash of this file so cached results are dropped
+// whenever the simulator changes
+#ifndef CODE_VERSION
+#define CODE_VERSION __DATE__ " " __TIME__
+#endif
 
 enum EventType { ARRIVAL, DEPARTURE, OBSERVER };
 
@@ -36,11 +56,156 @@ public:
     }
 };
 
+// KLL quantile sketch (Karnin, Lang, Liberty 2016). Level h holds items that
+// each stand for 2^h samples. A full level is sorted and every other item,
+// starting at a random offset, is promoted to the next level, so memory stays
+// around 3k items however long the run is. Sketches of the same quantity from
+// separate runs can be merged.
+class KllSketch {
+public:
+    int k;
+    std::vector<std::vector<double>> levels;
+    int size;
+    int maxSize;
+    long count;
+    uint64_t coin;
+
+    KllSketch(int t_k = 200) {
+        k = t_k;
+        size = 0;
+        maxSize = 0;
+        count = 0;
+        coin = 0x9e3779b97f4a7c15ull;
+        grow();
+    }
+
+    void insert(double value) {
+        levels[0].push_back(value);
+        size += 1;
+        count += 1;
+        if (size >= maxSize) { compress(); }
+    }
+
+    // Adds `weight` samples of one value at once, as one item on every level
+    // whose bit is set in the weight
+    void insert(double value, long weight) {
+        for (int h = 0; weight >> h; h++) {
+            if ((weight >> h & 1) == 0) { continue; }
+            while ((int)levels.size() <= h) { grow(); }
+            levels[h].push_back(value);
+            size += 1;
+        }
+        count += weight;
+        while (size >= maxSize) { compress(); }
+    }
+
+    void merge(KllSketch &other) {
+        while (levels.size() < other.levels.size()) { grow(); }
+        for (int h = 0; h < (int)other.levels.size(); h++) {
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        }
+        size += other.size;
+        count += other.count;
+        while (size >= maxSize) { compress(); }
+    }
+
+    double quantile(double q) {
+        std::vector<std::pair<double, long>> weighted;
+        for (int h = 0; h < (int)levels.size(); h++) {
+            for (auto value: levels[h]) {
+                weighted.push_back({value, 1L << h});
+            }
+        }
+        if (weighted.empty()) { return 0; }
+        std::sort(weighted.begin(), weighted.end());
+
+        long total = 0;
+        for (auto &item: weighted) {
+            total += item.second;
+        }
+        long seen = 0;
+        for (auto &item: weighted) {
+            seen += item.second;
+            if (seen >= q * total) { return item.first; }
+        }
+        return weighted.back().first;
+    }
+
+    void write(std::ostream &out) {
+        out << count << " " << levels.size() << std::endl;
+        for (auto &level: levels) {
+            out << level.size();
+            for (auto value: level) {
+                out << " " << value;
+            }
+            out << std::endl;
+        }
+    }
+
+    bool read(std::istream &in) {
+        int height;
+        if (!(in >> count >> height)) { return false; }
+        levels.clear();
+        size = 0;
+        for (int h = 0; h < height; h++) {
+            grow();
+            int items;
+            in >> items;
+            levels[h].resize(items);
+            for (auto &value: levels[h]) {
+                in >> value;
+            }
+            size += items;
+        }
+        return (bool)in;
+    }
+
+private:
+    int capacity(int h) {
+        return 2 * (int)ceil(k * pow(2.0 / 3.0, levels.size() - h - 1)) + 1;
+    }
+
+    void grow() {
+        levels.push_back({});
+        maxSize = 0;
+        for (int h = 0; h < (int)levels.size(); h++) {
+            maxSize += capacity(h);
+        }
+    }
+
+    void compress() {
+        for (int h = 0; h < (int)levels.size(); h++) {
+            if ((int)levels[h].size() < capacity(h)) { continue; }
+            if (h + 1 == (int)levels.size()) { grow(); }
+
+            auto &level = levels[h];
+            std::sort(level.begin(), level.end());
+            coin = coin * 6364136223846793005ull + 1442695040888963407ull;
+            int offset = coin >> 63;
+            // An odd item out stays behind
+            int pairs = level.size() / 2;
+            for (int i = 0; i < pairs; i++) {
+                levels[h + 1].push_back(level[2 * i + offset]);
+            }
+            level.erase(level.begin(), level.begin() + 2 * pairs);
+
+            size = 0;
+            for (auto &l: levels) {
+                size += l.size();
+            }
+            if (size < maxSize) { break; }
+        }
+    }
+};
+
 struct Result {
     double rho;
     double packetLoss;
     double queueSizeTotal;
     double idleTimeTotal;
+    // Distributions of per-packet sojourn time and observed queue size
+    KllSketch sojourn;
+    KllSketch occupancy;
 
     Result() {
         rho = 0;
@@ -54,27 +219,39 @@ double startRho = 0.25;
 double endRho = 0.95;
 double incrementRho = 0.10;
 double arrivalRatio = 500;
-double T = 1000;
-double queueSize = 0;
-double arrivalLambda = 0;
+// Settings of the point in progress are per thread so a server can run
+// several jobs at once, see serve()
+thread_local double T = 1000;
+thread_local double queueSize = 0;
+thread_local double arrivalLambda = 0;
 double lengthLambda = 0.0005;
 double c = 1000000;
-std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());;
-
-std::uniform_real_distribution<double> distribution(0.0, 1.0);
+// Runs are only reproducible, and so only cached, when seeded
+thread_local bool seeded = false;
+thread_local uint64_t seed = 0;
+std::string cacheDir = ".simcache";
+// Bytes of event buffers a point may hold, 0 for no limit. Larger runs are
+// processed in windows of simulated time.
+thread_local double memoryBudget = 0;
+// Servers for the event-list kernel, 0 runs the precomputed single-server path
+thread_local int servers = 0;
+thread_local std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());;
+
+thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
 
 void printResults(Result result) {
         std::cout  << "Rho: " << result.rho << ", Packet loss: " << result.packetLoss << ", Queue Size: " << result.queueSizeTotal << ", idleTimeTotal: " << result.idleTimeTotal << std::endl;
+        std::cout  << "    Sojourn p50/p99/p99.9: " << result.sojourn.quantile(0.5) << " " << result.sojourn.quantile(0.99) << " " << result.sojourn.quantile(0.999)
+                   << ", Queue Size p50/p99/p99.9: " << result.occupancy.quantile(0.5) << " " << result.occupancy.quantile(0.99) << " " << result.occupancy.quantile(0.999) << std::endl;
 }
 
 double exponentialValue(double lambda, double uniform) {
     return -(1 / lambda) * log(1 - uniform); 
 }
 
-std::vector<Event> generateArrivals(int simulationTime) {
+void generateArrivals(int simulationTime, std::vector<Event> &arrivalEvents) {
     double currTime = 0;
 
-    std::vector<Event> arrivalEvents;
     while (currTime < simulationTime) {
         double nextArrival = exponentialValue(arrivalLambda, distribution(generator));
         double serviceTime = exponentialValue(lengthLambda, distribution(generator)) / c;
@@ -82,15 +259,12 @@ std::vector<Event> generateArrivals(int simulationTime) {
         arrivalEvents.push_back(newEvent);
         currTime = nextArrival + currTime;
      }
-
-    return arrivalEvents;
 }
 
-std::vector<Event> generateDepartures(std::vector<Event> arrivals, int simulationTime) {
+void generateDepartures(const std::vector<Event> &arrivals, int simulationTime, std::vector<Event> &departures) {
     double currTime = 0;
-    std::vector<Event> departures;
 
-    for (auto a: arrivals) {
+    for (auto &a: arrivals) {
         double departureTime = 0;
 
         if (a.timestamp <= currTime) {
@@ -103,23 +277,17 @@ std::vector<Event> generateDepartures(std::vector<Event> arrivals, int simulatio
 
         departures.push_back(Event(departureTime, DEPARTURE));
     }
-
-    return departures;
 }
 
-std::vector<Event> generateDepartures(std::vector<Event> arrivals, int simulationTime, int queueSize) {
+void generateDepartures(const std::vector<Event> &arrivals, int simulationTime, int queueSize, std::vector<Event> &departures) {
 
     if (queueSize == 0) {
-        return generateDepartures(arrivals, simulationTime);
-    }
-
-    std::deque<Event> eventQueue;
-
-    for (auto c: arrivals) {
-        eventQueue.push_back(c);
+        generateDepartures(arrivals, simulationTime, departures);
+        return;
     }
 
-    std::vector<Event> departures;
+    // Next arrival to offer to the packet queue
+    size_t offered = 0;
     std::deque<Event> packetQueue;
 
     double currTime = 0;
@@ -130,18 +298,17 @@ std::vector<Event> generateDepartures(std::vector<Event> arrivals, int simulatio
     // On the next arrival event, attempt to add it to the packet queue.
     // If full, skip it and increment packet loss counter, otherwise add it.
 
-    while (currTime < simulationTime && (eventQueue.size() > 0 || packetQueue.size() > 0)) {
+    while (currTime < simulationTime && (offered < arrivals.size() || packetQueue.size() > 0)) {
         // Service packets in packet queue
-        while (packetQueue.size() > 0 && (eventQueue.size() == 0 || packetQueue.front().serviceTime + currTime < eventQueue.front().timestamp)) {
+        while (packetQueue.size() > 0 && (offered == arrivals.size() || packetQueue.front().serviceTime + currTime < arrivals[offered].timestamp)) {
             currTime += packetQueue.front().serviceTime;
             departures.push_back(Event(currTime, DEPARTURE));
             packetQueue.pop_front();
         }
 
-        if (eventQueue.size() == 0) { continue; }
+        if (offered == arrivals.size()) { continue; }
 
-        Event next = eventQueue.front();
-        eventQueue.pop_front();
+        Event next = arrivals[offered++];
 
         // packet loss
         if (packetQueue.size() == queueSize) {
@@ -154,75 +321,437 @@ std::vector<Event> generateDepartures(std::vector<Event> arrivals, int simulatio
             currTime = packetQueue.front().timestamp;
         }
     }
-
-    return departures;
 }
 
-std::vector<Event>generateObservers(int simulationTime) {
+void generateObservers(int simulationTime, std::vector<Event> &observerEvents) {
     double currTime = 0;
 
-    std::vector<Event> observerEvents;
     while (currTime < simulationTime) {
         double nextArrival = exponentialValue(arrivalLambda*5.0, distribution(generator));
         Event newEvent(nextArrival + currTime, OBSERVER);
         observerEvents.push_back(newEvent);
         currTime = nextArrival + currTime;
      }
+}
+
+// State of the precomputed kernel, kept between calls so a run can also be
+// fed one window of simulated time at a time
+class DesState {
+public:
+    Result result;
+    int currentQueueSize;
+    // Arrival times of admitted packets, departures leave in FIFO order
+    std::deque<double> admitted;
+
+    DesState() {
+        currentQueueSize = 0;
+    }
+
+    // Applies the events of three time-sorted streams that happen before
+    // `end` in one merged pass, and returns how many departures it used
+    size_t walk(const std::vector<Event> &arrivals, const std::vector<Event> &departures, const std::vector<Event> &observers,
+                double end, int size) {
+        size_t a = 0, d = 0, o = 0;
+        while (true) {
+            const Event *next = a < arrivals.size() ? &arrivals[a] : NULL;
+            if (d < departures.size() && (!next || departures[d].timestamp < next->timestamp)) { next = &departures[d]; }
+            if (o < observers.size() && (!next || observers[o].timestamp < next->timestamp)) { next = &observers[o]; }
+            if (!next || next->timestamp >= end) { break; }
+
+            auto event = *next;
+            a += event.type == ARRIVAL;
+            d += event.type == DEPARTURE;
+            o += event.type == OBSERVER;
+
+            switch (event.type) {
+            case ARRIVAL:
+                if (size > 0 && currentQueueSize == size) {
+                    result.packetLoss += 1;
+                } else {
+                    currentQueueSize += 1;
+                    admitted.push_back(event.timestamp);
+                }
+                break;
+            case DEPARTURE:
+                currentQueueSize -= 1;
+                if (admitted.size() > 0) {
+                    result.sojourn.insert(event.timestamp - admitted.front());
+                    admitted.pop_front();
+                }
+                break;
+            case OBSERVER:
+                result.queueSizeTotal += currentQueueSize;
+                result.occupancy.insert(currentQueueSize);
 
-    return observerEvents; 
+                if (currentQueueSize == 0) {
+                    result.idleTimeTotal += 1;
+                }
+                break;
+            }
+        }
+        return d;
+    }
+};
+
+Result runDes(const std::vector<Event> &arrivals, const std::vector<Event> &departures, const std::vector<Event> &observers,
+              int simulationTime, int size) {
+    DesState state;
+    state.walk(arrivals, departures, observers, simulationTime, size);
+
+    Result result = state.result;
+    result.packetLoss /= arrivals.size();
+    result.queueSizeTotal /= observers.size();
+    result.idleTimeTotal /= observers.size();
+
+    return result;
 }
 
-Result runDes(std::vector<Event> events, int simulationTime, int size, int arrivalsSize, int observersSize) {
-    std::deque<Event> queue;
+// Event buffers shared by every sweep point, so a sweep stops allocating once
+// they have grown to the largest point
+class EventArena {
+public:
+    std::vector<Event> arrivals;
+    std::vector<Event> departures;
+    std::vector<Event> observers;
+
+    // Room for a Poisson number of arrivals with mean `expected`, plus four
+    // standard deviations
+    void prepare(double expected) {
+        arrivals.clear();
+        departures.clear();
+        observers.clear();
+        arrivals.reserve(expected + 4 * sqrt(expected) + 64);
+        departures.reserve(expected + 4 * sqrt(expected) + 64);
+        observers.reserve(5 * expected + 4 * sqrt(5 * expected) + 64);
+    }
 
-    for (auto e: events) {
-        queue.push_back(e);
+    size_t bytes() {
+        return (arrivals.capacity() + departures.capacity() + observers.capacity()) * sizeof(Event);
     }
+};
+
+thread_local EventArena arena;
+
+// Longest stretch of simulated time whose events fit in the memory budget,
+// T when the whole run does
+double chunkWindow() {
+    // An arrival, at most one departure and five observers per packet, with
+    // a tenth held back for the reserve slack
+    double bytesPerSecond = 7 * arrivalLambda * sizeof(Event);
+    if (memoryBudget <= 0 || bytesPerSecond * T <= 0.9 * memoryBudget) { return T; }
+    return 0.9 * memoryBudget / bytesPerSecond;
+}
+
+// runDes over successive windows of simulated time, holding one window of
+// events at a time. Departures are found as in generateDepartures, with the
+// packets still queued carried from one window to the next.
+Result runChunkedDes(int simulationTime, int size, double window) {
+    auto &arrivals = arena.arrivals;
+    auto &departures = arena.departures;
+    auto &observers = arena.observers;
+    arena.prepare(arrivalLambda * window);
+
+    DesState state;
+    long arrivalCount = 0;
+    long observerCount = 0;
+    Event nextArrival(exponentialValue(arrivalLambda, distribution(generator)),
+                      exponentialValue(lengthLambda, distribution(generator)) / c, ARRIVAL);
+    double nextObserver = exponentialValue(arrivalLambda * 5.0, distribution(generator));
+    // Departure times of the packets in the queue
+    std::deque<double> queued;
+    double lastDeparture = 0;
+
+    for (double start = 0; start < simulationTime; start += window) {
+        double end = std::min(start + window, (double)simulationTime);
+        arrivals.clear();
+        observers.clear();
+        while (nextArrival.timestamp < end) {
+            arrivals.push_back(nextArrival);
+            nextArrival = Event(nextArrival.timestamp + exponentialValue(arrivalLambda, distribution(generator)),
+                                exponentialValue(lengthLambda, distribution(generator)) / c, ARRIVAL);
+        }
+        while (nextObserver < end) {
+            observers.push_back(Event(nextObserver, OBSERVER));
+            nextObserver += exponentialValue(arrivalLambda * 5.0, distribution(generator));
+        }
+
+        for (auto &arrival: arrivals) {
+            while (queued.size() > 0 && queued.front() <= arrival.timestamp) {
+                queued.pop_front();
+            }
+            if (size > 0 && (int)queued.size() == size) { continue; }
+            lastDeparture = std::max(arrival.timestamp, lastDeparture) + arrival.serviceTime;
+            queued.push_back(lastDeparture);
+            departures.push_back(Event(lastDeparture, DEPARTURE));
+        }
+
+        size_t used = state.walk(arrivals, departures, observers, end, size);
+        departures.erase(departures.begin(), departures.begin() + used);
+        arrivalCount += arrivals.size();
+        observerCount += observers.size();
+    }
+
+    Result result = state.result;
+    result.packetLoss /= arrivalCount;
+    result.queueSizeTotal /= observerCount;
+    result.idleTimeTotal /= observerCount;
+
+    return result;
+}
+
+void printMemory() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "Peak memory: " << usage.ru_maxrss / 1024.0 << " MB, event buffers: " << arena.bytes() / 1048576.0 << " MB" << std::endl;
+}
 
+// Calendar queue (R. Brown, 1988): a ring of buckets each covering `width`
+// seconds, like the days of a year. An event goes in bucket
+// floor(t / width) % buckets, a list kept sorted so the earliest sits at the
+// head. Dequeueing walks the ring from the current day, so insert and
+// extract-min are amortized O(1) while the width matches the event spacing.
+// The ring is resized, and the width re-estimated, whenever the number of
+// pending events doubles or halves. List entries live in one pool so the
+// queue does not allocate once it has grown.
+template <class Item>
+class CalendarQueue {
+public:
+    struct Entry {
+        Item item;
+        int next;
+    };
+
+    std::vector<Entry> pool;
+    std::vector<int> heads;
+    int freeList;
+    double width;
+    int count;
+    long day;
+
+    CalendarQueue() {
+        freeList = -1;
+        count = 0;
+        resize(2, 1.0, 0);
+    }
+
+    bool empty() {
+        return count == 0;
+    }
+
+    int size() {
+        return count;
+    }
+
+    void push(Item item) {
+        int entry = freeList;
+        if (entry < 0) {
+            entry = pool.size();
+            pool.push_back({item, -1});
+        } else {
+            freeList = pool[entry].next;
+            pool[entry].item = item;
+        }
+        link(entry);
+        count += 1;
+        if (count > 2 * (int)heads.size()) {
+            resize(2 * heads.size(), estimateWidth(), day * width);
+        }
+    }
+
+    Item pop() {
+        int entry = take();
+        Item item = pool[entry].item;
+        pool[entry].next = freeList;
+        freeList = entry;
+        count -= 1;
+        if (heads.size() > 2 && count < (int)heads.size() / 2) {
+            resize(heads.size() / 2, estimateWidth(), item.timestamp);
+        }
+        return item;
+    }
+
+private:
+    long dayOf(double timestamp) {
+        return (long)(timestamp / width);
+    }
+
+    void link(int entry) {
+        double timestamp = pool[entry].item.timestamp;
+        int *slot = &heads[dayOf(timestamp) % heads.size()];
+        while (*slot >= 0 && pool[*slot].item.timestamp <= timestamp) {
+            slot = &pool[*slot].next;
+        }
+        pool[entry].next = *slot;
+        *slot = entry;
+    }
+
+    int take() {
+        for (int i = 0; i < (int)heads.size(); i++) {
+            int &head = heads[day % heads.size()];
+            if (head >= 0 && dayOf(pool[head].item.timestamp) <= day) {
+                int entry = head;
+                head = pool[entry].next;
+                return entry;
+            }
+            day += 1;
+        }
+
+        // Nothing due this year, jump straight to the earliest event
+        int best = -1;
+        for (int i = 0; i < (int)heads.size(); i++) {
+            if (heads[i] >= 0 && (best < 0 || pool[heads[i]].item.timestamp < pool[heads[best]].item.timestamp)) {
+                best = i;
+            }
+        }
+        int entry = heads[best];
+        heads[best] = pool[entry].next;
+        day = dayOf(pool[entry].item.timestamp);
+        return entry;
+    }
+
+    // Three times the mean gap between the next few events, ignoring gaps
+    // that are much larger than the rest
+    double estimateWidth() {
+        int samples = std::min(count, 25);
+        if (samples < 2) { return width; }
+
+        std::vector<double> next;
+        for (auto head: heads) {
+            for (int entry = head; entry >= 0; entry = pool[entry].next) {
+                next.push_back(pool[entry].item.timestamp);
+            }
+        }
+        std::nth_element(next.begin(), next.begin() + samples - 1, next.end());
+        next.resize(samples);
+        std::sort(next.begin(), next.end());
+
+        double average = (next.back() - next.front()) / (samples - 1);
+        double total = 0;
+        int gaps = 0;
+        for (int i = 1; i < samples; i++) {
+            double gap = next[i] - next[i - 1];
+            if (gap <= 2 * average) {
+                total += gap;
+                gaps += 1;
+            }
+        }
+        return gaps > 0 && total > 0 ? 3 * total / gaps : width;
+    }
+
+    void resize(int size, double newWidth, double start) {
+        std::vector<int> old(size, -1);
+        old.swap(heads);
+        width = newWidth;
+        day = dayOf(std::max(start, 0.0));
+        for (auto head: old) {
+            while (head >= 0) {
+                int next = pool[head].next;
+                link(head);
+                head = next;
+            }
+        }
+    }
+};
+
+// Event-list DES of an M/M/servers/size queue. Unlike runDes(), events are
+// scheduled as the state evolves: a departure is only known once its packet
+// reaches a free server.
+Result runDynamicDes(int simulationTime, int servers, int size) {
+    CalendarQueue<Event> events;
+    std::deque<Event> waiting;
     Result result;
-    int currentQueueSize = 0;
-    double previousTime = 0;
+    int inSystem = 0;
+    int arrivals = 0;
+    int observers = 0;
 
-    int departureCount = 0;
-    int arrivalCount = 0;
-    while (queue.size() > 0) {
-        auto event = queue.front();
-        queue.pop_front();
+    events.push(Event(exponentialValue(arrivalLambda, distribution(generator)),
+                      exponentialValue(lengthLambda, distribution(generator)) / c, ARRIVAL));
+    events.push(Event(exponentialValue(arrivalLambda * 5.0, distribution(generator)), OBSERVER));
 
+    while (!events.empty()) {
+        Event event = events.pop();
         if (event.timestamp >= simulationTime) { break; }
 
         switch (event.type) {
         case ARRIVAL:
-            if (size > 0 && currentQueueSize == size) {
+            arrivals += 1;
+            events.push(Event(event.timestamp + exponentialValue(arrivalLambda, distribution(generator)),
+                              exponentialValue(lengthLambda, distribution(generator)) / c, ARRIVAL));
+            if (size > 0 && inSystem == size) {
                 result.packetLoss += 1;
+            } else if (++inSystem <= servers) {
+                events.push(Event(event.timestamp + event.serviceTime, DEPARTURE));
+                result.sojourn.insert(event.serviceTime);
             } else {
-                arrivalCount += 1;
-                currentQueueSize += 1;
+                waiting.push_back(event);
             }
             break;
         case DEPARTURE:
-            currentQueueSize -= 1;
-            departureCount += 1;
+            inSystem -= 1;
+            if (waiting.size() > 0) {
+                // The departure is known once service starts
+                Event next = waiting.front();
+                waiting.pop_front();
+                events.push(Event(event.timestamp + next.serviceTime, DEPARTURE));
+                result.sojourn.insert(event.timestamp + next.serviceTime - next.timestamp);
+            }
             break;
         case OBSERVER:
-            result.queueSizeTotal += currentQueueSize;
-
-            if (currentQueueSize == 0) {
+            observers += 1;
+            result.occupancy.insert(inSystem);
+            events.push(Event(event.timestamp + exponentialValue(arrivalLambda * 5.0, distribution(generator)), OBSERVER));
+            result.queueSizeTotal += inSystem;
+            if (inSystem == 0) {
                 result.idleTimeTotal += 1;
             }
             break;
         }
-
-        previousTime = event.timestamp; 
     }
 
-    result.packetLoss /= arrivalsSize;
-    result.queueSizeTotal /= observersSize;
-    result.idleTimeTotal /= observersSize;
+    result.packetLoss /= arrivals;
+    result.queueSizeTotal /= observers;
+    result.idleTimeTotal /= observers;
 
     return result;
 }
 
+// Hold-model benchmark of the calendar queue against std::priority_queue:
+// fill with `pending` events, then repeatedly pop the earliest and push a
+// replacement a random time later.
+void benchmarkScheduler(int pending, int holds) {
+    auto compare = [](const Event &a, const Event &b) { return a.timestamp > b.timestamp; };
+    std::priority_queue<Event, std::vector<Event>, decltype(compare)> heap(compare);
+    CalendarQueue<Event> calendar;
+
+    std::default_random_engine seeded(1);
+    std::vector<double> initial;
+    for (int i = 0; i < pending; i++) {
+        initial.push_back(exponentialValue(1, distribution(seeded)) * pending);
+    }
+
+    for (int run = 0; run < 2; run++) {
+        std::default_random_engine holdTimes(2);
+        auto start = std::chrono::steady_clock::now();
+        double checksum = 0;
+        for (auto t: initial) {
+            if (run == 0) { heap.push(Event(t, OBSERVER)); } else { calendar.push(Event(t, OBSERVER)); }
+        }
+        auto filled = std::chrono::steady_clock::now();
+        for (int i = 0; i < holds; i++) {
+            Event event = run == 0 ? heap.top() : calendar.pop();
+            if (run == 0) { heap.pop(); }
+            checksum += event.timestamp;
+            Event next(event.timestamp + exponentialValue(1, distribution(holdTimes)) * pending, OBSERVER);
+            if (run == 0) { heap.push(next); } else { calendar.push(next); }
+        }
+        std::chrono::duration<double, std::nano> fill = filled - start;
+        std::chrono::duration<double, std::nano> hold = std::chrono::steady_clock::now() - filled;
+        std::cout << (run == 0 ? "priority_queue" : "calendar queue") << ": " << pending << " pending, "
+                  << fill.count() / pending << " ns/push, " << hold.count() / holds << " ns/hold, checksum "
+                  << checksum << std::endl;
+    }
+}
+
 bool isStable(double v1, double v2) {
     if (v2 < 0.005) { return true; }
 
@@ -283,6 +812,458 @@ void outputGraphTxt4(std::vector<Result> results, std::string filename, bool sho
     txtOut.close();
 }
 
+// Queueing networks
+//
+// A network is a set of FIFO single-server stations, each with room for
+// `capacity` packets (0 for unlimited), a link rate in bits/s, and Poisson
+// arrivals from outside at `lambda` packets/s. A packet leaving a station
+// moves to station next[k] with probability probability[k], and leaves the
+// network otherwise. Service times are drawn afresh at every station as in a
+// Jackson network.
+//
+// Every station draws from its own generators in the order its packets arrive,
+// so the sequential and pipelined kernels below give identical results.
+class NetworkPacket {
+public:
+    double timestamp;
+    double born;
+    int station;
+    bool external;
+
+    NetworkPacket(double t_timestamp, double t_born, int t_station, bool t_external) {
+        timestamp = t_timestamp;
+        born = t_born;
+        station = t_station;
+        external = t_external;
+    }
+};
+
+class Station {
+public:
+    int capacity;
+    double rate;
+    double lambda;
+    std::vector<int> next;
+    std::vector<double> probability;
+
+    std::default_random_engine engine;
+    std::default_random_engine arrivalEngine;
+    std::deque<double> inSystem;
+    double lastDeparture;
+    double nextExternal;
+
+    long arrivals;
+    long drops;
+    long delivered;
+    double sojournTotal;
+    double delayTotal;
+
+    // Pipeline state, guarded by Network::lock
+    std::vector<int> upstream;
+    std::vector<double> marks;
+    std::vector<NetworkPacket> inbox;
+    double safe;
+
+    Station(int t_capacity, double t_rate, double t_lambda) {
+        capacity = t_capacity;
+        rate = t_rate;
+        lambda = t_lambda;
+        lastDeparture = 0;
+        nextExternal = INFINITY;
+        arrivals = 0;
+        drops = 0;
+        delivered = 0;
+        sojournTotal = 0;
+        delayTotal = 0;
+        safe = 0;
+    }
+
+    double uniform() {
+        return std::uniform_real_distribution<double>(0.0, 1.0)(engine);
+    }
+
+    void reset(unsigned seed) {
+        engine.seed(seed);
+        arrivalEngine.seed(seed ^ 0x9e3779b9);
+        inSystem.clear();
+        lastDeparture = 0;
+        nextExternal = INFINITY;
+        if (lambda > 0) {
+            nextExternal = exponentialValue(lambda, std::uniform_real_distribution<double>(0.0, 1.0)(arrivalEngine));
+        }
+        arrivals = drops = delivered = 0;
+        sojournTotal = delayTotal = 0;
+        inbox.clear();
+        std::fill(marks.begin(), marks.end(), 0);
+        safe = 0;
+    }
+
+    // Pops the next external arrival time
+    double external() {
+        double t = nextExternal;
+        nextExternal += exponentialValue(lambda, std::uniform_real_distribution<double>(0.0, 1.0)(arrivalEngine));
+        return t;
+    }
+
+    // Returns the departure time of a packet arriving at t, or -1 if the
+    // buffer is full. A FIFO server fixes the departure on arrival.
+    double admit(double t) {
+        while (inSystem.size() > 0 && inSystem.front() <= t) {
+            inSystem.pop_front();
+        }
+        arrivals += 1;
+        if (capacity > 0 && (int)inSystem.size() >= capacity) {
+            drops += 1;
+            return -1;
+        }
+        lastDeparture = std::max(t, lastDeparture) + exponentialValue(lengthLambda, uniform()) / rate;
+        inSystem.push_back(lastDeparture);
+        sojournTotal += lastDeparture - t;
+        return lastDeparture;
+    }
+
+    // Next station for a departing packet, -1 when it leaves the network
+    int route() {
+        double u = uniform();
+        for (int k = 0; k < (int)next.size(); k++) {
+            u -= probability[k];
+            if (u < 0) { return next[k]; }
+        }
+        return -1;
+    }
+
+    // Admits one packet and forwards it, returning the next station or -1
+    int serve(NetworkPacket &packet) {
+        double departure = admit(packet.timestamp);
+        if (departure < 0) { return -1; }
+        int station = route();
+        if (station < 0) {
+            delivered += 1;
+            delayTotal += departure - packet.born;
+            return -1;
+        }
+        packet = NetworkPacket(departure, packet.born, station, false);
+        return station;
+    }
+};
+
+class Network {
+public:
+    std::vector<Station> stations;
+    std::mutex lock;
+    std::condition_variable progress;
+    long generation;
+
+    // Either tandem:<hops>:<capacity>:<rho>, a chain at the lab's packet
+    // rates, or a file of lines "station <capacity> <rate> <lambda>" and
+    // "route <from> <to> <probability>"
+    Network(std::string spec) {
+        if (spec.rfind("tandem:", 0) == 0) {
+            int hops = 0, capacity = 0;
+            double rho = 0;
+            sscanf(spec.c_str(), "tandem:%d:%d:%lf", &hops, &capacity, &rho);
+            for (int i = 0; i < hops; i++) {
+                stations.push_back(Station(capacity, c, i == 0 ? rho * arrivalRatio : 0));
+                if (i > 0) {
+                    stations[i - 1].next.push_back(i);
+                    stations[i - 1].probability.push_back(1);
+                }
+            }
+        } else {
+            std::ifstream in(spec);
+            std::string line;
+            while (std::getline(in, line)) {
+                std::istringstream words(line);
+                std::string kind;
+                words >> kind;
+                if (kind == "station") {
+                    int capacity;
+                    double rate, lambda;
+                    words >> capacity >> rate >> lambda;
+                    stations.push_back(Station(capacity, rate, lambda));
+                } else if (kind == "route") {
+                    int from, to;
+                    double probability;
+                    words >> from >> to >> probability;
+                    stations[from].next.push_back(to);
+                    stations[from].probability.push_back(probability);
+                }
+            }
+        }
+
+        for (int i = 0; i < (int)stations.size(); i++) {
+            for (auto j: stations[i].next) {
+                stations[j].upstream.push_back(i);
+                stations[j].marks.push_back(0);
+            }
+        }
+        generation = 0;
+    }
+
+    // True when every route leads to a later station, which the pipeline needs
+    bool feedForward() {
+        for (int i = 0; i < (int)stations.size(); i++) {
+            for (auto j: stations[i].next) {
+                if (j <= i) { return false; }
+            }
+        }
+        return true;
+    }
+
+    void reset(unsigned seed) {
+        for (int i = 0; i < (int)stations.size(); i++) {
+            stations[i].reset(seed + i);
+        }
+        generation = 0;
+    }
+};
+
+// Sequential kernel for any routing, driven by the calendar queue
+void runNetworkEvents(Network &network, double simulationTime) {
+    CalendarQueue<NetworkPacket> events;
+    for (int i = 0; i < (int)network.stations.size(); i++) {
+        Station &station = network.stations[i];
+        if (station.nextExternal < simulationTime) {
+            double t = station.external();
+            events.push(NetworkPacket(t, t, i, true));
+        }
+    }
+
+    while (!events.empty()) {
+        NetworkPacket packet = events.pop();
+        Station &station = network.stations[packet.station];
+        if (packet.external && station.nextExternal < simulationTime) {
+            double t = station.external();
+            events.push(NetworkPacket(t, t, packet.station, true));
+        }
+        if (station.serve(packet) >= 0) {
+            events.push(packet);
+        }
+    }
+}
+
+// Processes every packet reaching `index` before the upstream stations'
+// common watermark. A packet arriving later departs later still, so that
+// watermark also bounds everything this station will send downstream.
+bool stepStation(Network &network, int index, double simulationTime, double window) {
+    Station &station = network.stations[index];
+    std::vector<NetworkPacket> batch;
+    double safe = INFINITY;
+    {
+        std::lock_guard<std::mutex> guard(network.lock);
+        for (auto mark: station.marks) {
+            safe = std::min(safe, mark);
+        }
+        if (station.nextExternal < simulationTime) {
+            double end = station.safe + window;
+            safe = std::min(safe, end >= simulationTime ? INFINITY : end);
+        }
+        if (safe <= station.safe) { return false; }
+
+        auto split = std::partition(station.inbox.begin(), station.inbox.end(),
+                                    [safe](const NetworkPacket &p) { return p.timestamp >= safe; });
+        batch.assign(split, station.inbox.end());
+        station.inbox.erase(split, station.inbox.end());
+    }
+
+    while (station.nextExternal < std::min(safe, simulationTime)) {
+        double t = station.external();
+        batch.push_back(NetworkPacket(t, t, index, true));
+    }
+    std::sort(batch.begin(), batch.end(),
+              [](const NetworkPacket &a, const NetworkPacket &b) { return a.timestamp < b.timestamp; });
+
+    std::vector<std::vector<NetworkPacket>> outgoing(network.stations.size());
+    for (auto packet: batch) {
+        int next = station.serve(packet);
+        if (next >= 0) {
+            outgoing[next].push_back(packet);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(network.lock);
+        for (auto next: station.next) {
+            Station &downstream = network.stations[next];
+            downstream.inbox.insert(downstream.inbox.end(), outgoing[next].begin(), outgoing[next].end());
+            for (int k = 0; k < (int)downstream.upstream.size(); k++) {
+                if (downstream.upstream[k] == index) { downstream.marks[k] = safe; }
+            }
+        }
+        station.safe = safe;
+        network.generation += 1;
+    }
+    network.progress.notify_all();
+    return true;
+}
+
+// Pipelined kernel for feed-forward networks. Each thread owns a contiguous
+// run of stations and advances whichever of them has new input, so the
+// stages of a long path overlap instead of running one after another.
+void runNetworkPipeline(Network &network, double simulationTime, int threads) {
+    double externalRate = 0;
+    for (auto &station: network.stations) {
+        externalRate += station.lambda;
+    }
+    // Roughly 4096 outside arrivals per batch
+    double window = externalRate > 0 ? 4096 / externalRate : simulationTime;
+
+    int count = network.stations.size();
+    threads = std::max(1, std::min(threads, count));
+    std::vector<std::thread> workers;
+    for (int w = 0; w < threads; w++) {
+        int first = w * count / threads;
+        int last = (w + 1) * count / threads;
+        workers.push_back(std::thread([&network, first, last, simulationTime, window]() {
+            while (true) {
+                long seen;
+                bool done = true;
+                {
+                    std::lock_guard<std::mutex> guard(network.lock);
+                    seen = network.generation;
+                }
+                bool advanced = false;
+                for (int i = first; i < last; i++) {
+                    advanced |= stepStation(network, i, simulationTime, window);
+                    done &= network.stations[i].safe == INFINITY;
+                }
+                if (done) { return; }
+                if (!advanced) {
+                    std::unique_lock<std::mutex> guard(network.lock);
+                    network.progress.wait(guard, [&network, seen]() { return network.generation != seen; });
+                }
+            }
+        }));
+    }
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
+
+void runNetwork(std::string spec, int threads) {
+    Network network(spec);
+    if (network.stations.empty()) {
+        std::cerr << "No stations in " << spec << std::endl;
+        return;
+    }
+    network.reset(generator());
+    bool pipelined = threads > 1 && network.feedForward();
+
+    auto start = std::chrono::steady_clock::now();
+    if (pipelined) {
+        runNetworkPipeline(network, T, threads);
+    } else {
+        runNetworkEvents(network, T);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    long external = 0;
+    long drops = 0;
+    long delivered = 0;
+    double delayTotal = 0;
+    for (int i = 0; i < (int)network.stations.size(); i++) {
+        Station &station = network.stations[i];
+        std::cout << "Station " << i << ": arrivals " << station.arrivals << ", loss " << (double)station.drops / std::max(station.arrivals, 1L)
+                  << ", mean sojourn " << station.sojournTotal / std::max(station.arrivals - station.drops, 1L) << std::endl;
+        drops += station.drops;
+        delivered += station.delivered;
+        delayTotal += station.delayTotal;
+    }
+    external = drops + delivered;
+    std::cout << "End-to-end: packets " << external << ", loss " << (double)drops / std::max(external, 1L)
+              << ", mean delay " << delayTotal / std::max(delivered, 1L) << ", "
+              << (pipelined ? "pipelined" : "sequential") << " in " << elapsed.count() << "s" << std::endl;
+}
+
+// Result cache
+//
+// Every seeded sweep point is stored in <cacheDir>/<hash>.result, keyed by a
+// hash of its full configuration. The key is repeated on the first line of the
+// file so a hash collision reads as a miss. Each point reseeds the generator
+// from its key, so a cached result is exactly what rerunning the point gives.
+uint64_t fnv1a(std::string text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char ch: text) {
+        hash = (hash ^ ch) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string pointKey(double rho) {
+    std::ostringstream key;
+    key.precision(17);
+    bool chunked = servers == 0 && chunkWindow() < T;
+    key << "l1 kernel=" << (servers > 0 ? "event-list" : chunked ? "chunked" : "precomputed");
+    if (chunked) { key << " memory=" << memoryBudget; }
+    key << " servers=" << std::max(servers, 1)
+        << " K=" << queueSize << " rho=" << rho << " T=" << T << " seed=" << seed;
+    return key.str();
+}
+
+std::string cachePath(std::string key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a(key + " version=" CODE_VERSION));
+    return cacheDir + "/" + name + ".result";
+}
+
+bool readCache(std::string key, Result &result) {
+    if (!seeded || cacheDir.empty()) { return false; }
+    std::ifstream in(cachePath(key));
+    std::string line;
+    if (!std::getline(in, line) || line != key + " version=" CODE_VERSION) { return false; }
+    return (bool)(in >> result.rho >> result.packetLoss >> result.queueSizeTotal >> result.idleTimeTotal)
+        && result.sojourn.read(in) && result.occupancy.read(in);
+}
+
+void writeCache(std::string key, Result result) {
+    if (!seeded || cacheDir.empty()) { return; }
+    std::string path = cachePath(key);
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream out(tmp, std::ofstream::out | std::ofstream::trunc);
+    out.precision(17);
+    out << key << " version=" CODE_VERSION << std::endl;
+    out << result.rho << " " << result.packetLoss << " " << result.queueSizeTotal << " " << result.idleTimeTotal << std::endl;
+    result.sojourn.write(out);
+    result.occupancy.write(out);
+    out.close();
+    rename(tmp.c_str(), path.c_str());
+}
+
+// Runs one point of a sweep with the current arrivalLambda, T, and queueSize
+Result simulatePoint() {
+    Result result;
+    if (servers > 0) {
+        arrivalLambda *= servers;
+        result = runDynamicDes(T, servers, queueSize);
+    } else {
+        double window = chunkWindow();
+        if (window < T) {
+            result = runChunkedDes(T, queueSize, window);
+        } else {
+            arena.prepare(arrivalLambda * T);
+            generateArrivals(T, arena.arrivals);
+            generateDepartures(arena.arrivals, T, queueSize, arena.departures);
+            generateObservers(T, arena.observers);
+            result = runDes(arena.arrivals, arena.departures, arena.observers, T, queueSize);
+        }
+    }
+    return result;
+}
+
+// Result of one point, from the cache when possible
+Result runPoint(double rho) {
+    arrivalLambda = rho * arrivalRatio;
+    Result result;
+    std::string key = pointKey(rho);
+    if (!readCache(key, result)) {
+        if (seeded) { generator.seed(fnv1a(key)); }
+        result = simulatePoint();
+        writeCache(key, result);
+    }
+    result.rho = rho;
+    return result;
+}
+
 std::vector<Result> runSimulation() {
     bool stable = false;
     Result prevResult;
@@ -293,34 +1274,7 @@ std::vector<Result> runSimulation() {
         double rho = startRho;
         results.clear();
         while (rho <= endRho + 0.05) {
-            arrivalLambda = rho * arrivalRatio;
-            auto arrivals = generateArrivals(T);
-            auto departures = generateDepartures(arrivals, T, queueSize);
-            auto observers = generateObservers(T);
-
-            std::vector<Event> events = arrivals;
-            events.insert(events.end(), departures.begin(), departures.end());
-            events.insert(events.end(), observers.begin(), observers.end());
-
-            std::sort(std::begin(events),
-                      std::end(events),
-                      [](Event a, Event b) { return a.timestamp < b.timestamp; });
-            
-            int count = 0;
-            for (auto event: events) {
-                std::string str;
-                if (event.type == ARRIVAL) {
-                    count += 1;
-                    str = "Arrival";
-                } else if (event.type == DEPARTURE) {
-                    count -= 1;
-                    str = "Departure";
-                }
-
-           //     std::cout << "count: " << count << " timestamp: " << event.timestamp << " type: " << str << std::endl;
-            }
-            auto result = runDes(events, T, queueSize, arrivals.size(), observers.size());
-            result.rho = rho;
+            Result result = runPoint(rho);
             printResults(result);
             results.push_back(result);
             if (rho > endRho - 0.05) {
@@ -345,9 +1299,476 @@ void runSimulation(int t_queueSize) {
     outputGraphTxt4(results, "q6_dataEn", t_queueSize == 10);
 }
 
+// Lane-parallel replications
+//
+// Advances W independent M/M/1/K replications in lockstep, one per SIMD lane.
+// Each step every live lane handles its own next event. All updates are
+// selects rather than branches, so the lane loop vectorizes, and every lane
+// draws from its own splitmix64 stream. Service is exponential, so it is
+// drawn when a packet reaches the server instead of at arrival. The lane loop
+// only notes which event each lane handled; record() then feeds sojourn and
+// occupancy samples into per-lane sketches in a scalar pass, as DesState
+// does, so percentiles come at the cost of that pass and not of vectorizing.
+
+// Natural log for x in (0, 1], without branches so it vectorizes. Splits x
+// into 2^e * m with m in [sqrt(1/2), sqrt(2)) and sums the atanh series of
+// log(m), accurate to about 1e-11.
+inline double laneLog(double x) {
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int64_t e = (int64_t)(bits >> 52) - 1023;
+    bits = (bits & 0x000fffffffffffffull) | 0x3ff0000000000000ull;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    bool high = m > 1.4142135623730951;
+    double half = m * 0.5;
+    m = high ? half : m;
+    e += high;
+
+    double s = (m - 1) / (m + 1);
+    double s2 = s * s;
+    double series = 1 + s2 * (1.0 / 3 + s2 * (1.0 / 5 + s2 * (1.0 / 7 + s2 * (1.0 / 9 + s2 * (1.0 / 11)))));
+    return e * 0.6931471805599453 + 2 * s * series;
+}
+
+template <int W>
+class Lanes {
+public:
+    uint64_t state[W];
+    double nextArrival[W];
+    double nextDeparture[W];
+    double nextObserver[W];
+    double queued[W];
+    double arrivals[W];
+    double losses[W];
+    double observers[W];
+    double queueTotal[W];
+    double idleTotal[W];
+    // Sample of the last step per lane: the event handled, -1 for none or a
+    // lost packet, its time and the queue size it found. The event is kept
+    // as a double so its selects vectorize with the rest.
+    double stepEvent[W];
+    double stepTime[W];
+    double stepQueue[W];
+    // Arrival times of admitted packets, departures leave in FIFO order
+    std::deque<double> waiting[W];
+    // Observations per queue size, loaded into occupancy once the run ends
+    std::vector<long> queueCounts[W];
+    KllSketch sojourn[W];
+    KllSketch occupancy[W];
+
+    Lanes(uint64_t seed) {
+        for (int l = 0; l < W; l++) {
+            state[l] = seed + l * 0x9e3779b97f4a7c15ull;
+            nextArrival[l] = exponential(l) / arrivalLambda;
+            nextObserver[l] = exponential(l) / (arrivalLambda * 5.0);
+            nextDeparture[l] = INFINITY;
+            queued[l] = arrivals[l] = losses[l] = observers[l] = queueTotal[l] = idleTotal[l] = 0;
+        }
+    }
+
+    // Lanes from `active` on never start, for a last batch that is not full
+    void retire(int active) {
+        for (int l = active; l < W; l++) {
+            nextArrival[l] = nextDeparture[l] = nextObserver[l] = INFINITY;
+        }
+    }
+
+    // Standard exponential from lane l's stream
+    inline double exponential(int l) {
+        uint64_t z = state[l] += 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        z ^= z >> 31;
+        return -laneLog(1 - (z >> 11) * 0x1.0p-53);
+    }
+
+    void run(double simulationTime, int size) {
+        double serviceRate = c * lengthLambda;
+        int live = W;
+        while (live > 0) {
+            live = 0;
+            for (int l = 0; l < W; l++) {
+                double ta = nextArrival[l];
+                double td = nextDeparture[l];
+                double to = nextObserver[l];
+                double first = std::min(ta, std::min(td, to));
+                // Bitwise rather than short-circuit operators, and every
+                // candidate time computed up front, so the compiler can turn
+                // the whole body into selects
+                bool running = first < simulationTime;
+                bool arrival = running & (ta == first);
+                bool departure = running & !arrival & (td == first);
+                bool observer = running & !arrival & !departure;
+
+                double e1 = exponential(l);
+                double e2 = exponential(l);
+                double n = queued[l];
+                bool full = (size > 0) & (n >= size);
+                bool admitted = arrival & !full;
+                double after = n + admitted - departure;
+
+                double arrivalNext = ta + e1 / arrivalLambda;
+                double observerNext = to + e1 / (arrivalLambda * 5.0);
+                double startNow = ta + e2 / serviceRate;
+                double startNext = td + e2 / serviceRate;
+                nextArrival[l] = arrival ? arrivalNext : ta;
+                nextObserver[l] = observer ? observerNext : to;
+                // Service starts when a packet finds the server idle, or when
+                // a departure leaves others waiting
+                double leaving = after > 0 ? startNext : INFINITY;
+                double departed = departure ? leaving : td;
+                nextDeparture[l] = admitted & (n == 0) ? startNow : departed;
+                queued[l] = after;
+
+                double noted = observer ? OBSERVER : -1;
+                noted = departure ? DEPARTURE : noted;
+                stepEvent[l] = admitted ? ARRIVAL : noted;
+                stepTime[l] = first;
+                stepQueue[l] = n;
+
+                arrivals[l] += arrival;
+                losses[l] += arrival & full;
+                observers[l] += observer;
+                queueTotal[l] += observer ? n : 0;
+                idleTotal[l] += observer & (n == 0);
+                live += running;
+            }
+            record();
+        }
+        for (int l = 0; l < W; l++) {
+            for (int q = 0; q < (int)queueCounts[l].size(); q++) {
+                if (queueCounts[l][q] > 0) { occupancy[l].insert(q, queueCounts[l][q]); }
+            }
+        }
+    }
+
+    void record() {
+        for (int l = 0; l < W; l++) {
+            switch ((int)stepEvent[l]) {
+            case ARRIVAL:
+                waiting[l].push_back(stepTime[l]);
+                break;
+            case DEPARTURE:
+                sojourn[l].insert(stepTime[l] - waiting[l].front());
+                waiting[l].pop_front();
+                break;
+            case OBSERVER: {
+                size_t q = stepQueue[l];
+                if (q >= queueCounts[l].size()) { queueCounts[l].resize(q + 1, 0); }
+                queueCounts[l][q] += 1;
+                break;
+            }
+            }
+        }
+    }
+};
+
+// Two-sided 95% Student t quantile
+double studentT95(int df) {
+    static const double table[] {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    return df <= 30 ? table[std::max(df, 1) - 1] : 1.96 + 2.4 / df;
+}
+
+void printInterval(std::string name, std::vector<double> &values) {
+    int r = values.size();
+    double mean = 0;
+    for (auto v: values) {
+        mean += v / r;
+    }
+    double variance = 0;
+    for (auto v: values) {
+        variance += (v - mean) * (v - mean) / (r - 1);
+    }
+    std::cout << "    " << name << ": " << mean << " +- " << studentT95(r - 1) * sqrt(variance / r) << std::endl;
+}
+
+template <int W>
+std::vector<Result> runLanes(int replications, uint64_t base) {
+    std::vector<Result> results;
+    for (int batch = 0; batch * W < replications; batch++) {
+        Lanes<W> lanes(fnv1a(std::to_string(base) + " " + std::to_string(batch)));
+        int active = std::min(W, replications - batch * W);
+        lanes.retire(active);
+        lanes.run(T, queueSize);
+        for (int l = 0; l < active; l++) {
+            Result result;
+            result.packetLoss = lanes.losses[l] / lanes.arrivals[l];
+            result.queueSizeTotal = lanes.queueTotal[l] / lanes.observers[l];
+            result.idleTimeTotal = lanes.idleTotal[l] / lanes.observers[l];
+            result.sojourn = lanes.sojourn[l];
+            result.occupancy = lanes.occupancy[l];
+            results.push_back(result);
+        }
+    }
+    return results;
+}
+
+// Prints confidence intervals of the per-replication means, and percentiles
+// of the distributions pooled by merging every replication's sketches
+void printReplications(std::string name, std::vector<Result> &results, double seconds) {
+    std::vector<double> loss, en, idle;
+    KllSketch sojourn, occupancy;
+    for (auto &result: results) {
+        loss.push_back(result.packetLoss);
+        en.push_back(result.queueSizeTotal);
+        idle.push_back(result.idleTimeTotal);
+        sojourn.merge(result.sojourn);
+        occupancy.merge(result.occupancy);
+    }
+    std::cout << name << ": " << results.size() << " replications in " << seconds << "s" << std::endl;
+    printInterval("Packet loss", loss);
+    printInterval("Queue Size", en);
+    printInterval("idleTimeTotal", idle);
+    std::cout << "    Sojourn p50/p99/p99.9: " << sojourn.quantile(0.5) << " " << sojourn.quantile(0.99) << " " << sojourn.quantile(0.999)
+              << ", Queue Size p50/p99/p99.9: " << occupancy.quantile(0.5) << " " << occupancy.quantile(0.99) << " " << occupancy.quantile(0.999) << std::endl;
+}
+
+// Runs `replications` of M/M/1/K at rho in W lanes, then one after another
+// through the precomputed kernel for comparison
+void compareReplications(int replications, double rho, int width) {
+    arrivalLambda = rho * arrivalRatio;
+    uint64_t base = seeded ? seed : std::chrono::system_clock::now().time_since_epoch().count();
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Result> results;
+    switch (width) {
+    case 4: results = runLanes<4>(replications, base); break;
+    case 16: results = runLanes<16>(replications, base); break;
+    default: results = runLanes<8>(replications, base); width = 8; break;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printReplications(std::to_string(width) + " lanes", results, elapsed.count());
+
+    start = std::chrono::steady_clock::now();
+    std::vector<Result> serial;
+    for (int r = 0; r < (int)results.size(); r++) {
+        serial.push_back(simulatePoint());
+    }
+    elapsed = std::chrono::steady_clock::now() - start;
+    printReplications("Serial", serial, elapsed.count());
+}
+
+// Simulation server
+//
+// ./main.out 5 <socket> [threads] listens on a Unix domain socket. Clients
+// send one job per line as key=value pairs, e.g. "id=7 rho=0.9 K=10 T=500
+// seed=1", and get one line back per job, tagged with its id, as soon as it
+// finishes, so the results of a batch may arrive out of order. The worker
+// threads stay up between jobs, each with its own generator and event arena;
+// every job starts from the options the server was started with.
+class Connection {
+public:
+    int fd;
+    std::mutex lock;
+
+    Connection(int t_fd) {
+        fd = t_fd;
+    }
+
+    ~Connection() {
+        close(fd);
+    }
+
+    void reply(std::string line) {
+        std::lock_guard<std::mutex> guard(lock);
+        line += "\n";
+        for (size_t sent = 0; sent < line.size(); ) {
+            ssize_t n = send(fd, line.c_str() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) { return; }
+            sent += n;
+        }
+    }
+};
+
+class Job {
+public:
+    std::shared_ptr<Connection> connection;
+    std::string spec;
+};
+
+class JobQueue {
+public:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Job> jobs;
+
+    void push(Job job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(job);
+        }
+        ready.notify_one();
+    }
+
+    Job pop() {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this]() { return jobs.size() > 0; });
+        Job job = jobs.front();
+        jobs.pop_front();
+        return job;
+    }
+};
+
+std::string runJob(std::string spec) {
+    std::istringstream words(spec);
+    std::string word, id, error;
+    double rho = 0.5;
+    while (words >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : word.substr(eq + 1);
+        if (key == "id") { id = value; }
+        else if (key == "rho") { rho = strtod(value.c_str(), NULL); }
+        else if (key == "K") { queueSize = strtol(value.c_str(), NULL, 10); }
+        else if (key == "T") { T = strtod(value.c_str(), NULL); }
+        else if (key == "servers") { servers = strtol(value.c_str(), NULL, 10); }
+        else if (key == "memory") { memoryBudget = strtod(value.c_str(), NULL) * 1024 * 1024; }
+        else if (key == "seed") { seeded = true; seed = strtoull(value.c_str(), NULL, 10); }
+        else { error = "unknown key " + key; }
+    }
+    if (error.empty() && (rho <= 0 || T <= 0 || queueSize < 0 || servers < 0)) {
+        error = "bad parameters";
+    }
+
+    std::ostringstream out;
+    out.precision(17);
+    out << "id=" << id;
+    if (!error.empty()) {
+        out << " error=\"" << error << "\"";
+        return out.str();
+    }
+    Result result = runPoint(rho);
+    out << " rho=" << rho << " K=" << queueSize << " servers=" << std::max(servers, 1) << " T=" << T
+        << " loss=" << result.packetLoss << " En=" << result.queueSizeTotal << " idle=" << result.idleTimeTotal
+        << " sojourn=" << result.sojourn.quantile(0.5) << "," << result.sojourn.quantile(0.99) << "," << result.sojourn.quantile(0.999)
+        << " occupancy=" << result.occupancy.quantile(0.5) << "," << result.occupancy.quantile(0.99) << "," << result.occupancy.quantile(0.999);
+    return out.str();
+}
+
+int serve(std::string path, int threads) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Cannot listen on " << path << std::endl;
+        return 1;
+    }
+
+    // The server's own options are every job's defaults
+    double defaultT = T;
+    double defaultQueueSize = queueSize;
+    int defaultServers = servers;
+    double defaultMemory = memoryBudget;
+    bool defaultSeeded = seeded;
+    uint64_t defaultSeed = seed;
+
+    JobQueue queue;
+    for (int i = 0; i < threads; i++) {
+        std::thread([&queue, i, defaultT, defaultQueueSize, defaultServers, defaultMemory, defaultSeeded, defaultSeed]() {
+            generator.seed(std::chrono::system_clock::now().time_since_epoch().count() + i);
+            while (true) {
+                Job job = queue.pop();
+                T = defaultT;
+                queueSize = defaultQueueSize;
+                servers = defaultServers;
+                memoryBudget = defaultMemory;
+                seeded = defaultSeeded;
+                seed = defaultSeed;
+                job.connection->reply(runJob(job.spec));
+            }
+        }).detach();
+    }
+    std::cerr << "Serving on " << path << " with " << threads << " workers" << std::endl;
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) { continue; }
+        auto connection = std::make_shared<Connection>(fd);
+        std::thread([connection, &queue]() {
+            std::string pending;
+            char buffer[4096];
+            ssize_t n;
+            while ((n = read(connection->fd, buffer, sizeof(buffer))) > 0) {
+                pending.append(buffer, n);
+                size_t end;
+                while ((end = pending.find('\n')) != std::string::npos) {
+                    std::string line = pending.substr(0, end);
+                    pending.erase(0, end + 1);
+                    if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                        queue.push(Job {connection, line});
+                    }
+                }
+            }
+            // The connection closes once its last job has replied
+        }).detach();
+    }
+}
+
 int main(int argc, char* argv[]) {
+    // seed=<n> makes runs reproducible and cached in cache=<dir> (empty
+    // disables), memory=<MB> bounds the event buffers of each point
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("seed=", 0) == 0) {
+            seeded = true;
+            seed = strtoull(arg.substr(5).c_str(), NULL, 10);
+        } else if (arg.rfind("cache=", 0) == 0) {
+            cacheDir = arg.substr(6);
+        } else if (arg.rfind("memory=", 0) == 0) {
+            memoryBudget = strtod(arg.substr(7).c_str(), NULL) * 1024 * 1024;
+        } else {
+            args.push_back(arg);
+        }
+    }
+    argc = args.size() + 1;
+    for (int i = 1; i < argc; i++) {
+        argv[i] = (char *)args[i - 1].c_str();
+    }
+    if (seeded && !cacheDir.empty()) {
+        mkdir(cacheDir.c_str(), 0755);
+    }
 
     int mode = strtol(argv[1], NULL, 10);
+    if (mode == 3) {
+        // ./main.out 3 [pending]
+        int pending = argc > 2 ? strtol(argv[2], NULL, 10) : 1000000;
+        benchmarkScheduler(pending, 2 * pending);
+        return 0;
+    }
+    if (mode == 4) {
+        // ./main.out 4 <tandem:hops:capacity:rho | file> [threads] [T]
+        int threads = argc > 3 ? strtol(argv[3], NULL, 10) : std::thread::hardware_concurrency();
+        T = argc > 4 ? strtod(argv[4], NULL) : T;
+        if (seeded) { generator.seed(seed); }
+        runNetwork(argc > 2 ? argv[2] : "tandem:10:10:0.9", threads);
+        return 0;
+    }
+    if (mode == 5 && argc > 2) {
+        // ./main.out 5 <socket> [threads]
+        return serve(argv[2], argc > 3 ? strtol(argv[3], NULL, 10) : std::thread::hardware_concurrency());
+    }
+    if (mode == 6 && argc > 3) {
+        // ./main.out 6 <replications> <rho> [queueSize] [T] [lanes]
+        queueSize = argc > 4 ? strtol(argv[4], NULL, 10) : 10;
+        T = argc > 5 ? strtod(argv[5], NULL) : T;
+        compareReplications(strtol(argv[2], NULL, 10), strtod(argv[3], NULL), argc > 6 ? strtol(argv[6], NULL, 10) : 8);
+        return 0;
+    }
+    if (mode == 2) {
+        // ./main.out 2 <servers> [queueSize]
+        servers = argc > 2 ? strtol(argv[2], NULL, 10) : 1;
+        queueSize = argc > 3 ? strtol(argv[3], NULL, 10) : 0;
+        runSimulation();
+        printMemory();
+        return 0;
+    }
+
     if (mode == 0) {
         startRho = 0.25;
         endRho = 0.95;
@@ -365,5 +1786,6 @@ int main(int argc, char* argv[]) {
         outputGraphTxt1(results, "q3_data1");
         outputGraphTxt2(results, "q3_data2");
     }
+    printMemory();
 }
 
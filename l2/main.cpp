@@ -9,19 +9,62 @@
 #include <string>
 #include <fstream>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-double T = 1000;
+// Set by the Makefile from a hash of this file so cached results are dropped
+// whenever the simulator changes
+#ifndef CODE_VERSION
+#define CODE_VERSION __DATE__ " " __TIME__
+#endif
+
+// Settings and counters of the run in progress are per thread so a server
+// can run several jobs at once, see serve()
+thread_local double T = 1000;
 double c = 3 * pow(10, 8);
-double T_PROP = 10.0 / (2.0 / 3.0 * c);
+double V_PROP = 2.0 / 3.0 * c;
 double T_TRANS = 1500.0 / 1000000.0;
 
-bool nPersistant = false;
+// What a node does when it senses the bus busy: wait for it to go idle and
+// send (persistent), back off for a random time (Npersistent), or wait for it
+// to go idle and send with probability persistenceP (Ppersistent)
+enum Persistence { PERSISTENT, NON_PERSISTENT, P_PERSISTENT };
+thread_local Persistence persistence = PERSISTENT;
+thread_local double persistenceP = 0.5;
+thread_local std::string topologySpec = "bus:10";
+// Directory for per-run telemetry reports, none if empty
+std::string reportDir;
+// Use the mean-field approximation instead of simulating every node
+thread_local bool meanFieldEngine = false;
+// Runs are only reproducible, and so only cached, when seeded
+thread_local bool seeded = false;
+thread_local uint64_t seed = 0;
+std::string cacheDir = ".simcache";
 
-int transmissionAttempts = 0;
-int transmitted = 0;
+thread_local long transmissionAttempts = 0;
+thread_local long transmitted = 0;
 
-std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());;
-std::uniform_real_distribution<double> distribution(0.0, 1.0);
+thread_local std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());;
+thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
 
 
 // Utils
@@ -30,35 +73,422 @@ double exponentialValue(double lambda) {
     return -(1 / lambda) * log(1 - uniform);
 }
 
-double backoff(int n) {
-    std::uniform_int_distribution<int> int_distribution(0, pow(2, n));
-    int randVal = int_distribution(generator);
-    return (double)randVal * 512.0 / 1000000.0;
+double exponentialValue(double lambda, double uniform) {
+    return -(1 / lambda) * log(1 - uniform);
 }
 
-std::deque<double> generateFrames(double lambda) {
-    double currTime = 0;
-    std::deque<double> frames;
+std::string persistenceName(Persistence p) {
+    switch (p) {
+    case NON_PERSISTENT: return "Npersistent";
+    case P_PERSISTENT: return "Ppersistent";
+    default: return "persistent";
+    }
+}
+
+bool isPersistence(std::string name) {
+    return name == "persistent" || name == "Npersistent" || name == "Ppersistent";
+}
+
+Persistence parsePersistence(std::string name) {
+    if (name == "Npersistent") { return NON_PERSISTENT; }
+    if (name == "Ppersistent") { return P_PERSISTENT; }
+    return PERSISTENT;
+}
+
+// splitmix64 stream handed out from a buffer refilled BATCH values at a time.
+// Every output depends only on its counter, so the refill loop vectorizes.
+class BatchRng {
+public:
+    static const int BATCH = 64;
+    uint64_t counter;
+    uint64_t buffer[BATCH];
+    int next;
+
+    BatchRng(uint64_t t_seed) {
+        counter = t_seed;
+        next = BATCH;
+    }
+
+    void refill() {
+        for (int i = 0; i < BATCH; i++) {
+            uint64_t z = counter + (i + 1) * 0x9E3779B97F4A7C15ULL;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            buffer[i] = z ^ (z >> 31);
+        }
+        counter += BATCH * 0x9E3779B97F4A7C15ULL;
+        next = 0;
+    }
+
+    uint64_t operator()() {
+        if (next == BATCH) { refill(); }
+        return buffer[next++];
+    }
+
+    double uniform() {
+        return ((*this)() >> 11) * 0x1.0p-53;
+    }
+
+    // Uniform integer in [0, range)
+    uint32_t below(uint32_t range) {
+        return (((*this)() >> 32) * range) >> 32;
+    }
+};
+
+double SLOT_TIME = 512.0 / 1000000.0;
+
+// Number of possible backoff slots after n collisions, [0, 2^n]
+const uint32_t SLOT_RANGE[] = {2, 3, 5, 9, 17, 33, 65, 129, 257, 513, 1025, 2049};
+
+int backoffSlots(int n, BatchRng &engine) {
+    return engine.below(SLOT_RANGE[n]);
+}
+
+// Log-bucketed histogram of durations in the style of HdrHistogram. Values are
+// kept in nanoseconds with SUB_BITS bits below the leading one, so a bucket
+// never spans more than 1/8 of its values. The counts live inline and nothing
+// is allocated when recording.
+class LogHistogram {
+public:
+    static const int SUB_BITS = 3;
+    static const int MAX_EXPONENT = 47;
+    static const int BUCKETS = (MAX_EXPONENT - SUB_BITS + 2) << SUB_BITS;
+    uint32_t counts[BUCKETS];
+    uint64_t total;
+
+    LogHistogram() {
+        std::fill(counts, counts + BUCKETS, 0);
+        total = 0;
+    }
+
+    static int bucket(uint64_t value) {
+        value = std::min<uint64_t>(value, (1ULL << (MAX_EXPONENT + 1)) - 1);
+        if (value < (1ULL << SUB_BITS)) { return value; }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) + ((value >> shift) & ((1 << SUB_BITS) - 1));
+    }
+
+    // Smallest value in nanoseconds that falls into bucket `index`
+    static uint64_t lowest(int index) {
+        if (index < (1 << SUB_BITS)) { return index; }
+        int shift = (index >> SUB_BITS) - 1;
+        return (uint64_t)((1 << SUB_BITS) | (index & ((1 << SUB_BITS) - 1))) << shift;
+    }
+
+    void record(double seconds) {
+        counts[bucket(seconds * 1e9)] ++;
+        total ++;
+    }
+
+    void merge(const LogHistogram &other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+    }
+
+    // Upper edge of the bucket holding quantile q, in seconds. Buckets below
+    // 2^SUB_BITS hold a single value, which is returned as is.
+    double percentile(double q) {
+        if (total == 0) { return 0; }
+        uint64_t rank = std::max<uint64_t>(1, ceil(q * total));
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                bool exact = i < (1 << SUB_BITS) || i + 1 == BUCKETS;
+                return (exact ? lowest(i) : lowest(i + 1)) / 1e9;
+            }
+        }
+        return lowest(BUCKETS - 1) / 1e9;
+    }
+};
+
+// Per-node counters, updated only by the thread that owns the node
+class NodeStats {
+public:
+    int collisions;
+    int drops;
+    long backoffSlots;
+    int deferrals;
+    // Time from a frame reaching the head of its queue to its successful send
+    LogHistogram accessDelay;
+
+    NodeStats() {
+        collisions = 0;
+        drops = 0;
+        backoffSlots = 0;
+        deferrals = 0;
+    }
+};
+
+// Captured arrival traces
+//
+// A trace file holds per-node frame arrival times, in seconds from the start
+// of the capture, in native byte order:
+//
+//     char magic[8] = "L2TRACE1"
+//     uint64_t nodes
+//     { uint64_t offset, count } index[nodes]    offset in bytes from file start
+//     double times[]                              each node's times, sorted
+//
+// The file is memory-mapped read-only and nodes read their section in place.
+// Pages behind a node's cursor are handed back as it advances, so traces much
+// larger than memory replay in a bounded footprint.
+//
+// When a run has more nodes than the trace, node i replays trace node
+// i mod nodes, rotated by a per-replica offset: replica r = i / nodes starts
+// at offset frac(r phi) of the duration and wraps around to the start, so
+// replicas keep the trace's load and burst shape without sending in lockstep.
+class TraceFile {
+public:
+    std::string path;
+    const char *base;
+    size_t size;
+    long modified;
+    uint64_t nodes;
+    // Just past the last arrival in the trace, so a run of this length
+    // replays all of it
+    double duration;
+    const uint64_t *index;
+
+    TraceFile(std::string t_path) {
+        path = t_path;
+        base = NULL;
+        size = 0;
+        modified = 0;
+        nodes = 0;
+        duration = 0;
+        index = NULL;
+
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || info.st_size < 16) {
+            if (fd >= 0) { close(fd); }
+            return;
+        }
+        size = info.st_size;
+        modified = info.st_mtime;
+        void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) { return; }
+        madvise(map, size, MADV_SEQUENTIAL);
+
+        base = (const char *)map;
+        memcpy(&nodes, base + 8, sizeof(nodes));
+        index = (const uint64_t *)(base + 16);
+        if (memcmp(base, "L2TRACE1", 8) != 0 || 16 + nodes * 16 > size) {
+            nodes = 0;
+            return;
+        }
+        for (uint64_t i = 0; i < nodes; i++) {
+            if (index[2 * i] % sizeof(double) != 0 || index[2 * i] + index[2 * i + 1] * sizeof(double) > size) {
+                nodes = 0;
+                return;
+            }
+            if (index[2 * i + 1] > 0) {
+                duration = std::max(duration, end(i)[-1]);
+            }
+        }
+        duration = nextafter(duration, INFINITY);
+    }
+
+    ~TraceFile() {
+        if (base) { munmap((void *)base, size); }
+    }
+
+    bool valid() {
+        return nodes > 0;
+    }
 
-    while (currTime < T) {
-        double nextTime = currTime + exponentialValue(lambda);
-        frames.push_back(nextTime);
-        currTime = nextTime;
+    const double *begin(uint64_t node) {
+        return (const double *)(base + index[2 * node]);
     }
 
-    return frames;
+    const double *end(uint64_t node) {
+        return begin(node) + index[2 * node + 1];
+    }
+
+    // Start of replica r's rotation, see above
+    double offset(uint64_t replica) {
+        return fmod(replica * 0.6180339887498949, 1.0) * duration;
+    }
+};
+
+TraceFile *traceFile = NULL;
+
+// Offered loads of the sweeps. A trace sets its own load and length, so those
+// sweeps run once per N over the whole trace and label it A=0.
+std::vector<int> sweepLoads() {
+    if (traceFile) { return {0}; }
+    return {7, 10, 20};
+}
+
+// Converts text lines of "<node> <seconds>" to a trace file in two streaming
+// passes, counting frames per node and then writing each into its section of
+// the mapped output, so neither file has to fit in memory
+int convertTrace(std::string textPath, std::string tracePath) {
+    std::vector<uint64_t> counts;
+    FILE *in = fopen(textPath.c_str(), "r");
+    if (!in) {
+        std::cerr << "Cannot read " << textPath << std::endl;
+        return 1;
+    }
+    long node;
+    double time;
+    while (fscanf(in, "%ld %lf", &node, &time) == 2) {
+        if (node < 0) { continue; }
+        if (node >= (long)counts.size()) { counts.resize(node + 1, 0); }
+        counts[node] ++;
+    }
+
+    uint64_t nodes = counts.size();
+    std::vector<uint64_t> index(2 * nodes);
+    uint64_t offset = 16 + 16 * nodes;
+    for (uint64_t i = 0; i < nodes; i++) {
+        index[2 * i] = offset;
+        index[2 * i + 1] = counts[i];
+        offset += counts[i] * sizeof(double);
+    }
+
+    int fd = open(tracePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, offset) != 0) {
+        std::cerr << "Cannot write " << tracePath << std::endl;
+        return 1;
+    }
+    char *out = (char *)mmap(NULL, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (out == MAP_FAILED) {
+        std::cerr << "Cannot map " << tracePath << std::endl;
+        return 1;
+    }
+    memcpy(out, "L2TRACE1", 8);
+    memcpy(out + 8, &nodes, sizeof(nodes));
+    memcpy(out + 16, index.data(), index.size() * sizeof(uint64_t));
+
+    std::vector<uint64_t> written(nodes, 0);
+    std::vector<bool> sorted(nodes, true);
+    rewind(in);
+    while (fscanf(in, "%ld %lf", &node, &time) == 2) {
+        if (node < 0) { continue; }
+        double *times = (double *)(out + index[2 * node]);
+        uint64_t &n = written[node];
+        if (n > 0 && times[n - 1] > time) { sorted[node] = false; }
+        times[n++] = time;
+    }
+    fclose(in);
+
+    for (uint64_t i = 0; i < nodes; i++) {
+        if (!sorted[i]) {
+            double *times = (double *)(out + index[2 * i]);
+            std::sort(times, times + counts[i]);
+        }
+    }
+    munmap(out, offset);
+
+    uint64_t total = 0;
+    for (auto count: counts) {
+        total += count;
+    }
+    std::cout << "Wrote " << total << " arrivals for " << nodes << " nodes to " << tracePath << std::endl;
+    return 0;
 }
 
+// Arrivals for a single node, either lazily generated Poisson arrivals or a
+// cursor into the node's section of a trace file. Only the next arrival time
+// is kept, so memory does not grow with T.
+class ArrivalStream {
+public:
+    double lambda;
+    double next;
+    std::default_random_engine engine;
+    // Trace cursor, NULL for Poisson arrivals, and the shift added to the
+    // times it reads
+    const double *trace;
+    const double *traceEnd;
+    double shift;
+    // Part of the section replayed after wrapping around, empty if none
+    const double *wrapBegin;
+    const double *wrapEnd;
+    double wrapShift;
+    // Start of the pages not yet handed back
+    const double *released;
+
+    // Trace pages are handed back 1MB at a time
+    static const long RELEASE = (1 << 20) / sizeof(double);
+
+    ArrivalStream(double t_lambda, unsigned t_seed) : engine(t_seed) {
+        lambda = t_lambda;
+        trace = traceEnd = released = wrapBegin = wrapEnd = NULL;
+        shift = wrapShift = 0;
+        next = exponentialValue(lambda, distribution(engine));
+    }
+
+    // Replays `node` of the trace from `offset` to its end, then from its
+    // start up to `offset`, with times moved back so the replay starts at 0
+    ArrivalStream(TraceFile &file, uint64_t node, double offset) {
+        lambda = 0;
+        wrapBegin = file.begin(node);
+        traceEnd = file.end(node);
+        wrapEnd = trace = released = std::lower_bound(wrapBegin, traceEnd, offset);
+        shift = -offset;
+        wrapShift = file.duration - offset;
+        // The search faulted in pages all over the section, hand them back
+        release(wrapBegin, traceEnd);
+        if (trace == traceEnd) { nextLap(); }
+        next = trace < traceEnd ? *trace + shift : INFINITY;
+    }
+
+    void nextLap() {
+        trace = released = wrapBegin;
+        traceEnd = wrapEnd;
+        shift = wrapShift;
+        wrapBegin = wrapEnd = NULL;
+    }
+
+    double peek() {
+        return next;
+    }
+
+    double pop() {
+        double arrival = next;
+        if (!trace) {
+            next += exponentialValue(lambda, distribution(engine));
+            return arrival;
+        }
+
+        trace ++;
+        if (trace == traceEnd && wrapBegin < wrapEnd) { nextLap(); }
+        next = trace < traceEnd ? *trace + shift : INFINITY;
+        if (trace - released >= RELEASE) {
+            released = release(released, trace);
+        }
+        return arrival;
+    }
+
+    // Hands back the whole pages in [from, to) and returns where they end
+    static const double *release(const double *from, const double *to) {
+        long page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = ((uintptr_t)from + page - 1) / page * page;
+        uintptr_t end = (uintptr_t)to / page * page;
+        if (end <= start) { return from; }
+        madvise((void *)start, end - start, MADV_DONTNEED);
+        return (const double *)end;
+    }
+};
+
 class Result {
 public:
     int a;
     int n;
     double efficiency;
     double throughput;
+    double delay;
 
     Result(double t_efficiency, double t_throughput) {
         efficiency = t_efficiency;
         throughput = t_throughput;
+        delay = 0;
         a = 0;
         n = 0;
     }
@@ -70,22 +500,76 @@ public:
     int pos;
     int collisionCount;
     double nextFrame;
-    int frameCount;
+    ArrivalStream arrivals;
+    // Backoff draws, kept per node so they do not depend on what other nodes draw
+    BatchRng engine;
+    // Arrival times of frames waiting at this node, front is the one being sent
+    std::deque<double> frames;
+    double queueingDelay;
+    int sent;
+    // When the head frame reached the front of the queue
+    double headSince;
+    NodeStats stats;
 
-    Node(int t_lambda, int t_pos) {
+    // With a trace loaded, node i replays a rotation of the trace's node
+    // i mod its node count, see TraceFile
+    Node(int t_lambda, int t_pos) : arrivals(traceFile ? ArrivalStream(*traceFile, t_pos % traceFile->nodes, traceFile->offset(t_pos / traceFile->nodes))
+                                                       : ArrivalStream(t_lambda, generator())),
+                                    engine((uint64_t)generator() << 32 | generator()) {
         lambda = t_lambda;
         pos = t_pos;
         collisionCount = 0;
-        nextFrame = exponentialValue(lambda);
-        frameCount = generateFrames(lambda).size();
+        queueingDelay = 0;
+        sent = 0;
+        nextFrame = 0;
+        enqueueArrivals(0);
+    }
+
+    bool hasFrame() {
+        return frames.size() > 0;
+    }
+
+    // Queue every frame that arrived by `now`. An idle node pulls its next
+    // arrival so that nextFrame always points at the head frame.
+    void enqueueArrivals(double now) {
+        while (arrivals.peek() < T && (arrivals.peek() <= now || frames.size() == 0)) {
+            frames.push_back(arrivals.pop());
+        }
+        if (hasFrame()) {
+            nextFrame = std::max(frames.front(), now);
+            headSince = nextFrame;
+        }
+    }
+
+    // Head frame is done (sent or dropped) at `now`, move on to the next one
+    void finishFrame(double now) {
+        frames.pop_front();
+        collisionCount = 0;
+        enqueueArrivals(now);
+    }
+
+    // Frames that were never sent or dropped before the end of the simulation
+    int pendingFrames() {
+        int count = frames.size();
+        while (arrivals.peek() < T) {
+            arrivals.pop();
+            count ++;
+        }
+        return count;
+    }
+
+    double backoff(int n) {
+        int slots = backoffSlots(n, engine);
+        stats.backoffSlots += slots;
+        return slots * SLOT_TIME;
     }
 
     void handleCollision() {
         collisionCount += 1;
+        stats.collisions ++;
         if (collisionCount > 10) {
-            collisionCount = 0;
-            nextFrame += exponentialValue(lambda);
-            frameCount --;
+            stats.drops ++;
+            finishFrame(nextFrame);
         } else {
             nextFrame += backoff(collisionCount);
         }
@@ -93,31 +577,63 @@ public:
 
     void senderCollision(double max_delay) {
         handleCollision();
-        nextFrame = max_delay;
+        if (hasFrame()) {
+            nextFrame = std::max(frames.front(), max_delay);
+        }
     }
 
-    void senseBusy(double start, double end) {
+    // Returns true if the frame was dropped after too many deferrals
+    template <class Policy>
+    bool senseBusy(double start, double end) {
         if (start <= nextFrame && nextFrame < end) {
-            if(nPersistant) {
-                int attempt = 1;
-                while (attempt <= 11 && nextFrame < end) {
-                    nextFrame += backoff(attempt);
-                }
-                
-                if (attempt > 11) {
-                    transmissionAttempts += 1;
-                    frameCount --;           
-                }
-            } else {
-                nextFrame = end; //TODO: add backoff
-            }
+            stats.deferrals ++;
+            return Policy::defer(*this, end);
         }
+        return false;
     }
 
     void sendSuccessfully() {
-        collisionCount = 0;
-        nextFrame += exponentialValue(lambda);
-        frameCount --;
+        queueingDelay += nextFrame - frames.front();
+        stats.accessDelay.record(nextFrame - headSince);
+        sent ++;
+        finishFrame(nextFrame + T_TRANS);
+    }
+};
+
+// Persistence policies, chosen at compile time so that every protocol gets its
+// own copy of the simulation loop. defer() is called when the node's frame is
+// due while the bus is busy until `end` and returns true if it was dropped.
+class OnePersistent {
+public:
+    static bool defer(Node &node, double end) {
+        node.nextFrame = end;
+        return false;
+    }
+};
+
+class NonPersistent {
+public:
+    static bool defer(Node &node, double end) {
+        for (int attempt = 1; attempt <= 11 && node.nextFrame < end; attempt++) {
+            node.nextFrame += node.backoff(attempt);
+        }
+        if (node.nextFrame < end) {
+            node.stats.drops ++;
+            node.finishFrame(node.nextFrame);
+            return true;
+        }
+        return false;
+    }
+};
+
+class PPersistent {
+public:
+    static bool defer(Node &node, double end) {
+        node.nextFrame = end;
+        while (node.engine.uniform() >= persistenceP) {
+            node.nextFrame += SLOT_TIME;
+        }
+        return false;
     }
 };
 
@@ -130,78 +646,727 @@ std::vector<Node> generateNodes(int avgPackets, int n) {
     return nodes;
 }
 
-Result simulate(double simulationTime, std::vector<Node> nodes) {
+// Where the nodes sit and how long a signal takes between any two of them.
+// Every supported layout is described by per-node coordinates:
+//
+//   delay(i, j) = (|x_i - x_j| + hub_i + hub_j) / V_PROP + repeater * |segment_i - segment_j|
+//
+// i.e. distance along a cable, plus the drop cables to a hub, plus a fixed
+// delay per repeater crossed. Rows of the resulting delay table are what the
+// scans read. They are precomputed up to TABLE_LIMIT nodes (8MB) and above
+// that filled on demand, once per event that needs a scan, to keep memory
+// linear.
+const int TABLE_LIMIT = 1024;
 
-    double timer = 0;
+class Topology {
+public:
+    int n;
+    int stride;
+    // Cable position and drop cable length, kept in seconds of propagation so
+    // rows fill without a division
+    std::vector<double> x;
+    std::vector<double> hub;
+    std::vector<double> segment;
+    double repeater;
+    std::vector<double> table;
+    std::vector<double> scratch;
+    std::vector<double> maxDelay;
+    // Why the spec was rejected, empty if it was not
+    std::string error;
 
-    while (timer < simulationTime) {
-        // Retrieve next event
-        int minIdx = 0;
+    // Specs: bus:<spacing>, segments:<perSegment>:<spacing>:<repeaterDelay>,
+    // star:<arm>[:<maxArm>] and file:<path> with "x hub segment" per line.
+    // Lengths are in metres, delays in seconds. Without `precompute` only the
+    // coordinates are set up, which is all delay() and meanDelay() need, so
+    // that is also the cheap way to check a spec for a given n.
+    Topology(std::string spec, int t_n, bool precompute = true) {
+        n = t_n;
+        stride = (n + 63) / 64 * 64;
+        x.assign(n, 0);
+        hub.assign(n, 0);
+        segment.assign(n, 0);
+        repeater = 0;
+
+        std::vector<std::string> args;
+        std::stringstream ss(spec);
+        std::string arg;
+        while (std::getline(ss, arg, ':')) {
+            args.push_back(arg);
+        }
+        std::string kind = args.empty() ? "" : args[0];
+
+        double spacing, perSegment, arm, maxArm;
+        if (kind == "bus" && args.size() == 2 && parseLength(args[1], spacing)) {
+            for (int i = 0; i < n; i++) {
+                x[i] = i * spacing;
+            }
+        } else if (kind == "segments" && args.size() == 4 && parseLength(args[1], perSegment) && perSegment >= 1
+                   && perSegment == floor(perSegment) && parseLength(args[2], spacing) && parseLength(args[3], repeater)) {
+            for (int i = 0; i < n; i++) {
+                x[i] = i * spacing;
+                segment[i] = floor(i / perSegment);
+            }
+        } else if (kind == "star" && (args.size() == 2 || args.size() == 3) && parseLength(args[1], arm)
+                   && (args.size() == 2 ? parseLength(args[1], maxArm) : parseLength(args[2], maxArm)) && maxArm >= arm) {
+            std::uniform_real_distribution<double> arms(arm, maxArm);
+            for (int i = 0; i < n; i++) {
+                hub[i] = arms(generator);
+            }
+        } else if (kind == "file" && args.size() == 2) {
+            std::ifstream in(args[1]);
+            if (!in) {
+                error = "cannot read topology file " + args[1];
+                return;
+            }
+            for (int i = 0; i < n; i++) {
+                if (!(in >> x[i] >> hub[i] >> segment[i]) || !isfinite(x[i]) || !(hub[i] >= 0 && isfinite(hub[i])) || !isfinite(segment[i])) {
+                    error = "topology file " + args[1] + " has fewer than " + std::to_string(n) + " valid nodes";
+                    return;
+                }
+            }
+        } else {
+            error = "bad topology " + spec;
+            return;
+        }
+
+        for (int i = 0; i < n; i++) {
+            x[i] /= V_PROP;
+            hub[i] /= V_PROP;
+        }
+
+        if (!precompute) { return; }
+        scratch.assign(stride, 0);
+        if (n <= TABLE_LIMIT) {
+            table.assign((size_t)stride * n, 0);
+            for (int i = 0; i < n; i++) {
+                fill(i, &table[(size_t)i * stride]);
+            }
+        }
+        maxDelay.assign(n, 0);
+        for (int i = 0; i < n; i++) {
+            const double *delays = row(i);
+            maxDelay[i] = *std::max_element(delays, delays + n);
+        }
+    }
+
+    // Checks that spec describes n nodes, without drawing from the generator,
+    // so callers can reject a bad spec up front
+    static bool check(std::string spec, int n, std::string &error) {
+        bool star = spec.rfind("star:", 0) == 0;
+        error = Topology(spec, star ? 0 : n, false).error;
+        return error.empty();
+    }
+
+    // Parses all of `text` as a finite number >= 0
+    static bool parseLength(std::string text, double &value) {
+        char *end;
+        value = strtod(text.c_str(), &end);
+        return !text.empty() && *end == '\0' && isfinite(value) && value >= 0;
+    }
+
+    double delay(int i, int j) {
+        if (i == j) { return 0; }
+        return fabs(x[i] - x[j]) + hub[i] + hub[j] + repeater * fabs(segment[i] - segment[j]);
+    }
+
+    // Mean delay between two distinct nodes, sampled for large n
+    double meanDelay() {
+        if (n < 2) { return 0; }
+        double sum = 0;
+        long count = 0;
+        if (n <= 2048) {
+            for (int i = 0; i < n; i++) {
+                for (int j = i + 1; j < n; j++) {
+                    sum += delay(i, j);
+                    count ++;
+                }
+            }
+        } else {
+            std::minstd_rand sampler(1);
+            std::uniform_int_distribution<int> pick(0, n - 1);
+            while (count < 100000) {
+                int i = pick(sampler);
+                int j = pick(sampler);
+                if (i == j) { continue; }
+                sum += delay(i, j);
+                count ++;
+            }
+        }
+        return sum / count;
+    }
+
+    void fill(int i, double *out) {
+        for (int j = 0; j < n; j++) {
+            out[j] = fabs(x[i] - x[j]) + hub[i] + hub[j] + repeater * fabs(segment[i] - segment[j]);
+        }
+        out[i] = 0;
+    }
+
+    // Delays from node i to every node, padded to stride
+    const double *row(int i) {
+        if (table.size() > 0) {
+            return &table[(size_t)i * stride];
+        }
+        fill(i, scratch.data());
+        return scratch.data();
+    }
+};
+
+// Structure-of-arrays copy of the fields read by the per-event scans. Arrays
+// are padded to a multiple of 64 so every mask word is full; padding and nodes
+// without a frame have nextFrame = INFINITY and never match.
+class NodeTable {
+public:
+    std::vector<Node> &nodes;
+    Topology &topology;
+    std::vector<double> nextFrame;
+    std::vector<uint64_t> collideBits;
+    std::vector<uint64_t> senseBits;
+    int words;
+
+    NodeTable(std::vector<Node> &t_nodes, Topology &t_topology) : nodes(t_nodes), topology(t_topology) {
+        words = (nodes.size() + 63) / 64;
+        nextFrame.assign(words * 64, INFINITY);
+        collideBits.assign(words, 0);
+        senseBits.assign(words, 0);
         for (int i = 0; i < nodes.size(); i++) {
-            if (nodes[i].frameCount <= 0) { continue; }
-            if (nodes[i].nextFrame < nodes[minIdx].nextFrame) {
-                minIdx = i;
+            sync(i);
+        }
+    }
+
+    void sync(int i) {
+        nextFrame[i] = nodes[i].hasFrame() ? nodes[i].nextFrame : INFINITY;
+    }
+
+    int nextEvent(double &secondTime);
+    double scan(int sender, double sendTime, const double *delays);
+    template <class Policy>
+    int apply(int sender, double sendTime, const double *delays);
+};
+
+// Index of the node with the earliest pending frame, -1 if none are left.
+// Also returns the second earliest in secondTime.
+int NodeTable::nextEvent(double &secondTime) {
+    const double *next = nextFrame.data();
+    int n = words * 64;
+    double best = INFINITY;
+    double second = INFINITY;
+#if defined(__AVX512F__)
+    __m512d vbest = _mm512_set1_pd(INFINITY);
+    __m512d vsecond = _mm512_set1_pd(INFINITY);
+    for (int i = 0; i < n; i += 8) {
+        __m512d f = _mm512_loadu_pd(next + i);
+        vsecond = _mm512_min_pd(vsecond, _mm512_max_pd(vbest, f));
+        vbest = _mm512_min_pd(vbest, f);
+    }
+    double lanes[16];
+    _mm512_storeu_pd(lanes, vbest);
+    _mm512_storeu_pd(lanes + 8, vsecond);
+    int laneCount = 8;
+#elif defined(__AVX2__)
+    __m256d vbest = _mm256_set1_pd(INFINITY);
+    __m256d vsecond = _mm256_set1_pd(INFINITY);
+    for (int i = 0; i < n; i += 4) {
+        __m256d f = _mm256_loadu_pd(next + i);
+        vsecond = _mm256_min_pd(vsecond, _mm256_max_pd(vbest, f));
+        vbest = _mm256_min_pd(vbest, f);
+    }
+    double lanes[8];
+    _mm256_storeu_pd(lanes, vbest);
+    _mm256_storeu_pd(lanes + 4, vsecond);
+    int laneCount = 4;
+#else
+    const double *lanes = next;
+    int laneCount = n;
+#endif
+    for (int i = 0; i < laneCount; i++) {
+        second = std::min(second, std::max(best, lanes[i]));
+        best = std::min(best, lanes[i]);
+    }
+    for (int i = laneCount; i < 2 * laneCount && lanes != next; i++) {
+        second = std::min(second, lanes[i]);
+    }
+    secondTime = second;
+    if (best == INFINITY) { return -1; }
+
+    for (int i = 0; i < n; i++) {
+        if (next[i] == best) { return i; }
+    }
+    return -1;
+}
+
+// Fills collideBits/senseBits for a transmission from `sender` starting at
+// `sendTime` and returns the largest propagation delay to a colliding node,
+// or -1 if none. `delays` is the sender's row from Topology::row(), shared
+// with apply().
+double NodeTable::scan(int sender, double sendTime, const double *delays) {
+    const double *next = nextFrame.data();
+    double maxDelay = -1;
+
+#if defined(__AVX512F__)
+    __m512d vtime = _mm512_set1_pd(sendTime);
+    __m512d vtrans = _mm512_set1_pd(T_TRANS);
+    __m512d vmax = _mm512_set1_pd(-1);
+    for (int w = 0; w < words; w++) {
+        uint64_t collide = 0;
+        uint64_t sense = 0;
+        for (int k = 0; k < 64; k += 8) {
+            int i = w * 64 + k;
+            __m512d delay = _mm512_loadu_pd(delays + i);
+            __m512d arrival = _mm512_add_pd(vtime, delay);
+            __m512d f = _mm512_loadu_pd(next + i);
+            __mmask8 c = _mm512_cmp_pd_mask(f, arrival, _CMP_LT_OQ);
+            __mmask8 s = _mm512_cmp_pd_mask(f, _mm512_add_pd(arrival, vtrans), _CMP_LT_OQ) & ~c;
+            vmax = _mm512_mask_max_pd(vmax, c, vmax, delay);
+            collide |= (uint64_t)c << k;
+            sense |= (uint64_t)s << k;
+        }
+        collideBits[w] = collide;
+        senseBits[w] = sense;
+    }
+    maxDelay = _mm512_reduce_max_pd(vmax);
+#elif defined(__AVX2__)
+    __m256d vtime = _mm256_set1_pd(sendTime);
+    __m256d vtrans = _mm256_set1_pd(T_TRANS);
+    __m256d vmax = _mm256_set1_pd(-1);
+    for (int w = 0; w < words; w++) {
+        uint64_t collide = 0;
+        uint64_t sense = 0;
+        for (int k = 0; k < 64; k += 4) {
+            int i = w * 64 + k;
+            __m256d delay = _mm256_loadu_pd(delays + i);
+            __m256d arrival = _mm256_add_pd(vtime, delay);
+            __m256d f = _mm256_loadu_pd(next + i);
+            __m256d c = _mm256_cmp_pd(f, arrival, _CMP_LT_OQ);
+            __m256d s = _mm256_andnot_pd(c, _mm256_cmp_pd(f, _mm256_add_pd(arrival, vtrans), _CMP_LT_OQ));
+            vmax = _mm256_max_pd(vmax, _mm256_blendv_pd(vmax, delay, c));
+            collide |= (uint64_t)_mm256_movemask_pd(c) << k;
+            sense |= (uint64_t)_mm256_movemask_pd(s) << k;
+        }
+        collideBits[w] = collide;
+        senseBits[w] = sense;
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, vmax);
+    maxDelay = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#else
+    for (int w = 0; w < words; w++) {
+        uint64_t collide = 0;
+        uint64_t sense = 0;
+        for (int k = 0; k < 64; k++) {
+            int i = w * 64 + k;
+            double arrival = sendTime + delays[i];
+            uint64_t c = next[i] < arrival;
+            uint64_t s = (next[i] < arrival + T_TRANS) & (c ^ 1);
+            maxDelay = std::max(maxDelay, c ? delays[i] : -1.0);
+            collide |= c << k;
+            sense |= s << k;
+        }
+        collideBits[w] = collide;
+        senseBits[w] = sense;
+    }
+#endif
+
+    // The sender always senses itself
+    senseBits[sender / 64] &= ~(1ULL << (sender % 64));
+    return maxDelay;
+}
+
+// Applies the masks from scan() to the nodes and returns the number of extra
+// transmission attempts this caused
+template <class Policy>
+int NodeTable::apply(int sender, double sendTime, const double *delays) {
+    int attempts = 0;
+    for (int w = 0; w < words; w++) {
+        for (uint64_t bits = collideBits[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            nodes[i].handleCollision();
+            attempts ++;
+            sync(i);
+        }
+        for (uint64_t bits = senseBits[w]; bits; bits &= bits - 1) {
+            int i = w * 64 + __builtin_ctzll(bits);
+            double arrivalTime = sendTime + delays[i];
+            if (nodes[i].senseBusy<Policy>(arrivalTime, arrivalTime + T_TRANS)) {
+                attempts ++;
             }
+            sync(i);
         }
+    }
+    return attempts;
+}
+
+Result collectResult(double simulationTime, std::vector<Node> &nodes) {
+    double queueingDelay = 0;
+    for (auto &node: nodes) {
+        transmissionAttempts += node.pendingFrames();
+        queueingDelay += node.queueingDelay;
+    } 
+
+    double efficiency = (double)transmitted / (double)transmissionAttempts;
+    double throughput = (double)transmitted * T_TRANS / simulationTime;
+    auto result = Result(efficiency, throughput);
+    result.delay = transmitted > 0 ? queueingDelay / transmitted : 0;
+    return result;
+}
+
+template <class Policy>
+Result simulate(double simulationTime, std::vector<Node> &nodes, Topology &topology) {
+    NodeTable table(nodes, topology);
+    double timer = 0;
+    double secondTime;
+
+    while (timer < simulationTime) {
+        // Retrieve next event
+        int minIdx = table.nextEvent(secondTime);
+        if (minIdx < 0) { break; }
         Node &minNode = nodes[minIdx];
 
         timer = minNode.nextFrame;
-        // check collisions
-        int maxCollidingDistance = -1;
-
         transmissionAttempts ++;
-        
-        bool dropPacket = false;
-        
-        for (auto &node: nodes) {
-            if (node.frameCount <= 0 || node.pos == minNode.pos) { continue; }
-
-            int distance = abs(minNode.pos - node.pos);
-            double sendingTime = minNode.nextFrame;
-            double arrivalTime = sendingTime + T_PROP * distance;
-            double lastBit = arrivalTime + T_TRANS;
-
-            // collision case
-            if (node.nextFrame < arrivalTime) {
-                maxCollidingDistance = std::max(distance, maxCollidingDistance);
-                node.handleCollision();  
-                transmissionAttempts ++;
-            } else {
-                node.senseBusy(arrivalTime, lastBit);
-            }
+
+        // check collisions, unless every other frame starts after the signal
+        // has passed the farthest node
+        double maxCollidingDelay = -1;
+        if (secondTime < timer + topology.maxDelay[minIdx] + T_TRANS) {
+            const double *delays = topology.row(minIdx);
+            maxCollidingDelay = table.scan(minIdx, timer, delays);
+            transmissionAttempts += table.apply<Policy>(minIdx, timer, delays);
         }
 
-        if (maxCollidingDistance >= 0) {
-            minNode.senderCollision(minNode.nextFrame + T_TRANS + maxCollidingDistance * T_PROP); 
-        } else if (!dropPacket){
+        if (maxCollidingDelay >= 0) {
+            minNode.senderCollision(timer + T_TRANS + maxCollidingDelay); 
+        } else {
             transmitted ++;
-            //std::cout << transmitted << " " << minNode.nextFrame << " " << transmissionAttempts << std::endl;
             minNode.sendSuccessfully(); 
         }
+        table.sync(minIdx);
     }
 
-    for (auto node: nodes) {
-        if (node.frameCount < 0) {
-            std::cout << node.frameCount << std::endl;
+    return collectResult(simulationTime, nodes);
+}
+
+// Writes per-node telemetry and the access delay distribution of one run as
+// JSON to <reportDir>/<mode>_T<T>_A<a>_N<n>.json
+void writeReport(Result result, std::vector<Node> &nodes) {
+    std::string mode = persistenceName(persistence);
+    std::string name = mode + "_T" + std::to_string((long)T) + "_A" + std::to_string(result.a) + "_N" + std::to_string(result.n);
+    std::ofstream out(reportDir + "/" + name + ".json", std::ofstream::out | std::ofstream::trunc);
+
+    LogHistogram accessDelay;
+    double sentSum = 0;
+    double sentSquares = 0;
+    for (auto &node: nodes) {
+        accessDelay.merge(node.stats.accessDelay);
+        sentSum += node.sent;
+        sentSquares += (double)node.sent * node.sent;
+    }
+    // Jain's index over frames sent per node, 1 when every node got the same share
+    double fairness = sentSquares > 0 ? sentSum * sentSum / (nodes.size() * sentSquares) : 1;
+
+    out << "{\n";
+    out << "  \"mode\": \"" << mode << "\", \"topology\": \"" << topologySpec << "\", \"T\": " << T
+        << ", \"a\": " << result.a << ", \"n\": " << result.n << ",\n";
+    out << "  \"efficiency\": " << result.efficiency << ", \"throughput\": " << result.throughput
+        << ", \"fairness\": " << fairness << ",\n";
+    out << "  \"accessDelay\": {\"p50\": " << accessDelay.percentile(0.5) << ", \"p90\": " << accessDelay.percentile(0.9)
+        << ", \"p99\": " << accessDelay.percentile(0.99) << ", \"p999\": " << accessDelay.percentile(0.999) << "},\n";
+    out << "  \"nodes\": [\n";
+    for (int i = 0; i < nodes.size(); i++) {
+        Node &node = nodes[i];
+        out << "    {\"node\": " << i << ", \"sent\": " << node.sent << ", \"collisions\": " << node.stats.collisions
+            << ", \"drops\": " << node.stats.drops << ", \"backoffSlots\": " << node.stats.backoffSlots
+            << ", \"deferrals\": " << node.stats.deferrals << ", \"queued\": " << node.frames.size()
+            << ", \"p50\": " << node.stats.accessDelay.percentile(0.5) << ", \"p99\": " << node.stats.accessDelay.percentile(0.99)
+            << "}" << (i + 1 < nodes.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+    out.close();
+}
+
+// Mean-field approximation
+//
+// Instead of simulating nodes, treat the other N - 1 nodes as one Poisson
+// stream of attempts and solve for the per-attempt collision probability p by
+// damped fixed-point iteration:
+//
+//  - a node sends s = min(A, 1 / (N T_TRANS)) frames per second, the bus
+//    capacity shared evenly once the offered load N A T_TRANS exceeds 1
+//  - the backoff stage after k collisions is reached with probability p^k, so
+//    a frame takes E = (1 - p^11) / (1 - p) attempts, g = s E per second, and
+//    is dropped with probability p^11
+//  - an attempt finds the bus busy with probability b, the fraction of time
+//    taken by senders. If idle, it collides when another attempt starts within
+//    twice the mean pairwise delay. If busy, persistent nodes pile up at the end
+//    of the busy period and collide with the m = (N - 1) g T_TRANS others that
+//    arrived during it with probability KAPPA (1 - e^-m); Ppersistent ones only
+//    go with probability persistenceP, Npersistent ones back off and behave
+//    like idle attempts
+//  - a backlogged node sends its next frame right after its last one, before
+//    anyone else hears the bus go idle, so the share 1 - 1 / load of backlogged
+//    nodes does not collide
+//
+// KAPPA, the share of busy-period pile-ups that end in a collision, was fitted
+// with the calibrate mode. Frames a saturated node never gets to send count as
+// attempts, as in collectResult(). Cost does not depend on N or T.
+//
+// The model only holds well below saturation. Against exact runs it stays
+// within MEAN_FIELD_TOLERANCE up to an offered load N A T_TRANS of
+// MEAN_FIELD_MAX_LOAD for every protocol, while around and above saturation
+// the backlogged nodes collide far more than it assumes and the efficiency
+// error reaches 0.3 to 0.5 at large N. Points above that load are run anyway
+// but warned about.
+const double KAPPA = 0.7;
+const double MEAN_FIELD_TOLERANCE = 0.05;
+const double MEAN_FIELD_MAX_LOAD = 0.5;
+// Set once this thread has warned about an uncalibrated point
+thread_local bool meanFieldWarned = false;
+
+double offeredLoad(int avgPackets, int numNodes) {
+    return numNodes * avgPackets * T_TRANS;
+}
+
+class MeanField {
+public:
+    double p;
+    double b;
+    double g;
+    double served;
+    double dropped;
+    int iterations;
+
+    MeanField(int avgPackets, int numNodes, double meanDelay) {
+        double lambda = avgPackets;
+        double load = numNodes * lambda * T_TRANS;
+        double backlogged = std::max(0.0, 1 - 1 / load);
+        served = std::min(lambda, 1 / (numNodes * T_TRANS));
+
+        p = 0;
+        for (iterations = 0; iterations < 1000; iterations++) {
+            double attempts = 0;
+            double reach = 1;
+            for (int k = 0; k <= 10; k++) {
+                attempts += reach;
+                reach *= p;
+            }
+            dropped = reach;
+            g = served * attempts;
+            b = std::min(0.999, numNodes * g * (1 - p / 2) * T_TRANS);
+
+            double others = (numNodes - 1) * g;
+            double idleCollision = 1 - exp(-others * 2 * meanDelay);
+            double busyCollision = idleCollision;
+            if (persistence == PERSISTENT) {
+                busyCollision = KAPPA * (1 - exp(-others * T_TRANS));
+            } else if (persistence == P_PERSISTENT) {
+                busyCollision = KAPPA * (1 - exp(-others * T_TRANS * persistenceP));
+            }
+            double nextP = (1 - backlogged) * (b * busyCollision + (1 - b) * idleCollision);
+
+            double change = fabs(nextP - p);
+            p = 0.5 * p + 0.5 * nextP;
+            if (change < 1e-12) { break; }
         }
-        transmissionAttempts += node.frameCount;
-    } 
+    }
+};
 
-    double efficiency = (double)transmitted / (double)transmissionAttempts;
-    double throughput = (double)transmitted * T_TRANS / simulationTime;
-    return Result(efficiency, throughput);
+Result meanField(int avgPackets, int numNodes) {
+    if (offeredLoad(avgPackets, numNodes) > MEAN_FIELD_MAX_LOAD && !meanFieldWarned) {
+        meanFieldWarned = true;
+        std::cerr << "warning: the mean-field engine is only calibrated up to an offered load of " << MEAN_FIELD_MAX_LOAD
+                  << ", A=" << avgPackets << " N=" << numNodes << " offers " << offeredLoad(avgPackets, numNodes)
+                  << " and may be off by more than " << MEAN_FIELD_TOLERANCE << std::endl;
+    }
+    Topology topology(topologySpec, numNodes, false);
+    MeanField model(avgPackets, numNodes, topology.meanDelay());
+
+    double lambda = avgPackets;
+    double sent = model.served * (1 - model.dropped);
+    double unsent = lambda - model.served;
+    double efficiency = sent / (model.g + unsent);
+    double throughput = numNodes * sent * T_TRANS;
+    auto result = Result(efficiency, throughput);
+
+    // M/M/1 wait for frames at a node that keeps up, otherwise the backlog
+    // grows for the whole run and on average half of it is waited out
+    double rho = lambda / (model.served / (1 - model.b) + 1e-12);
+    if (lambda <= model.served && rho < 1) {
+        result.delay = rho / (1 - rho) * T_TRANS;
+    } else {
+        result.delay = (1 - model.served / lambda) * T / 2;
+    }
+    return result;
 }
 
-Result createSimulation(int avgPackets, int numNodes) {
+// Result cache
+//
+// Every seeded point is stored in <cacheDir>/<hash>.result, keyed by a hash of
+// its full configuration. The key is repeated on the first line of the file so
+// a hash collision reads as a miss. Each point reseeds the generator from its
+// key, so a cached result is exactly what rerunning the point gives. Runs that
+// write reports always simulate.
+uint64_t fnv1a(std::string text) {
+    uint64_t hash = 14695981039346656037ull;
+    for (unsigned char ch: text) {
+        hash = (hash ^ ch) * 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string pointKey(int avgPackets, int numNodes) {
+    std::ostringstream key;
+    key.precision(17);
+    key << "l2 mode=" << persistenceName(persistence);
+    if (persistence == P_PERSISTENT) { key << " p=" << persistenceP; }
+    key << " engine=" << (meanFieldEngine ? "meanfield" : "des") << " topology=" << topologySpec
+        << " A=" << avgPackets << " N=" << numNodes << " T=" << T;
+    if (seeded) { key << " seed=" << seed; }
+    if (traceFile) {
+        key << " trace=" << traceFile->path << ":" << traceFile->size << ":" << traceFile->modified;
+    }
+    return key.str();
+}
+
+// Applies one key=value run setting of a job or a point key to this thread,
+// returns false for keys that are not run settings
+bool applyOption(std::string key, std::string value) {
+    if (key == "T") { T = strtod(value.c_str(), NULL); }
+    else if (key == "mode") { persistence = parsePersistence(value); }
+    else if (key == "p") { persistenceP = strtod(value.c_str(), NULL); }
+    else if (key == "topology") { topologySpec = value; }
+    else if (key == "engine") { meanFieldEngine = value == "meanfield"; }
+    else if (key == "seed") { seeded = true; seed = strtoull(value.c_str(), NULL, 10); }
+    else { return false; }
+    return true;
+}
+
+// Value of `name` in a pointKey(), empty if it is not there
+std::string keyValue(std::string key, std::string name) {
+    size_t start = key.find(" " + name + "=");
+    if (start == std::string::npos) { return ""; }
+    start += name.size() + 2;
+    return key.substr(start, key.find(' ', start) - start);
+}
+
+// Rebuilds the settings a pointKey() was made from, so another process can
+// run the same point. Returns false if the key names a trace that is missing
+// here or differs from the one the key was made with.
+bool applyPointKey(std::string key) {
+    persistence = PERSISTENT;
+    persistenceP = 0.5;
+    topologySpec = "bus:10";
+    meanFieldEngine = false;
+    seeded = false;
+    seed = 0;
+
+    std::istringstream words(key);
+    std::string word;
+    std::string trace;
+    while (words >> word) {
+        size_t eq = word.find('=');
+        if (eq == std::string::npos) { continue; }
+        std::string name = word.substr(0, eq);
+        std::string value = word.substr(eq + 1);
+        if (name == "trace") { trace = value; }
+        else if (name != "A" && name != "N" && !applyOption(name, value)) { return false; }
+    }
+
+    if (trace.empty()) {
+        delete traceFile;
+        traceFile = NULL;
+        return true;
+    }
+    size_t modifiedAt = trace.rfind(':');
+    size_t sizeAt = trace.rfind(':', modifiedAt - 1);
+    std::string path = trace.substr(0, sizeAt);
+    if (!traceFile || traceFile->path != path) {
+        delete traceFile;
+        traceFile = new TraceFile(path);
+    }
+    return traceFile->valid() && std::to_string(traceFile->size) == trace.substr(sizeAt + 1, modifiedAt - sizeAt - 1)
+           && std::to_string(traceFile->modified) == trace.substr(modifiedAt + 1);
+}
+
+std::string cachePath(std::string key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)fnv1a(key + " version=" CODE_VERSION));
+    return cacheDir + "/" + name + ".result";
+}
+
+bool useCache() {
+    return seeded && !cacheDir.empty() && reportDir.empty();
+}
+
+bool readCache(std::string key, Result &result) {
+    if (!useCache()) { return false; }
+    std::ifstream in(cachePath(key));
+    std::string line;
+    double t;
+    if (!std::getline(in, line) || line != key + " version=" CODE_VERSION) { return false; }
+    return (bool)(in >> t >> result.a >> result.n >> result.efficiency >> result.throughput >> result.delay);
+}
+
+void writeCache(std::string key, Result result) {
+    if (!useCache()) { return; }
+    std::string path = cachePath(key);
+    std::string tmp = path + ".tmp" + std::to_string(getpid()) + "-" + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    std::ofstream out(tmp, std::ofstream::out | std::ofstream::trunc);
+    out.precision(17);
+    out << key << " version=" CODE_VERSION << std::endl;
+    out << T << " " << result.a << " " << result.n << " " << result.efficiency << " " << result.throughput << " " << result.delay << std::endl;
+    out.close();
+    rename(tmp.c_str(), path.c_str());
+}
+
+Result simulatePoint(int avgPackets, int numNodes) {
     transmitted = 0;
     transmissionAttempts = 0;
+    // main and runJob check the topology up front, so only a topology file
+    // with fewer nodes than a later point of a sweep fails here
+    std::string error;
+    if (!Topology::check(topologySpec, numNodes, error)) {
+        std::cerr << error << std::endl;
+        exit(1);
+    }
+    if (meanFieldEngine) {
+        auto result = meanField(avgPackets, numNodes);
+        result.a = avgPackets;
+        result.n = numNodes;
+        return result;
+    }
+
     auto nodes = generateNodes(avgPackets, numNodes);
+    Topology topology(topologySpec, numNodes);
 
-    auto result = simulate(T, nodes);
+    Result result(0, 0);
+    switch (persistence) {
+    case PERSISTENT: result = simulate<OnePersistent>(T, nodes, topology); break;
+    case NON_PERSISTENT: result = simulate<NonPersistent>(T, nodes, topology); break;
+    case P_PERSISTENT: result = simulate<PPersistent>(T, nodes, topology); break;
+    }
     result.a = avgPackets;
     result.n = numNodes;
+    if (!reportDir.empty()) {
+        writeReport(result, nodes);
+    }
+    return result;
+}
+
+// Result of one point, from the cache when possible
+Result runPoint(int avgPackets, int numNodes) {
+    Result result(0, 0);
+    std::string key = pointKey(avgPackets, numNodes);
+    if (!readCache(key, result)) {
+        if (seeded) { generator.seed(fnv1a(key)); }
+        result = simulatePoint(avgPackets, numNodes);
+        writeCache(key, result);
+    }
+    return result;
+}
 
-    std::cout << T << " " << result.a << " " << result.n << " " << result.efficiency << " " << result.throughput << std::endl;
+Result createSimulation(int avgPackets, int numNodes) {
+    Result result = runPoint(avgPackets, numNodes);
+    std::cout << T << " " << result.a << " " << result.n << " " << result.efficiency << " " << result.throughput << " " << result.delay << std::endl;
     return result; 
 }
 
@@ -243,18 +1408,19 @@ void write(std::vector<Result> results, std::string filename) {
 }
 
 int sim(std::string fileName){
-    std::vector<int> A {7, 10, 20};
+    std::vector<int> A = sweepLoads();
     std::vector<int> N {20, 40, 60, 80, 100};
 
     auto prev = Result(0, 0);
     std::vector<Result> results;
+    if (traceFile) { T = traceFile->duration; }
     while(1) {
         for (auto a: A) {
             for (auto n: N) {
                 auto result = createSimulation(a, n);
                 results.push_back(result);
-                if (result.a == 20 && result.n == 100) {
-                    if (isStable(prev, result)) {
+                if (result.a == A.back() && result.n == N.back()) {
+                    if (isStable(prev, result) || traceFile) {
                         write(results, fileName);
                         std::cout << "Stable" << std::endl;
                         return 0;
@@ -271,16 +1437,645 @@ int sim(std::string fileName){
     createSimulation(7, 20);
 }
 
-int main() {
-    clear("persistentEf");
-    clear("persistentTh");
-    clear("NpersistentEf");
-    clear("NpersistentTh");
-    sim("persistent");
-    
-    nPersistant = true;
-    
-    sim("Npersistent");
+// Sharded sweeps
+//
+// Every point of a sweep round is a shard in a shared directory, named after
+// its mode, T, A, N and a hash of its pointKey() and CODE_VERSION, as in the
+// result cache, so results left by older code are never reused. The pending
+// list holds the point keys themselves, so workers run each point with the
+// exact settings of the sweep, whatever options they were started with. A
+// worker claims a shard by creating <name>.claim exclusively and publishes it
+// by renaming <name>.result into place, then drops the claim, so forked
+// workers and workers on other machines sharing the directory never run the
+// same point twice. Results already on disk are reused, which is how failed
+// sweeps resume.
+//
+// A claim is a lease: its owner touches it every CLAIM_LEASE / 4 seconds while
+// it runs the point, and any worker may break a claim that has not been
+// touched for CLAIM_LEASE seconds, or whose owner on this host is gone. A
+// lease broken under a live but stalled owner at worst runs the point twice,
+// and the result is published by rename either way.
+class SweepPoint {
+public:
+    // pointKey() of the point, which carries its whole configuration
+    std::string key;
+    std::string mode;
+    double t;
+    int a;
+    int n;
+
+    SweepPoint(std::string t_key) {
+        key = t_key;
+        mode = keyValue(key, "mode");
+        t = strtod(keyValue(key, "T").c_str(), NULL);
+        a = strtol(keyValue(key, "A").c_str(), NULL, 10);
+        n = strtol(keyValue(key, "N").c_str(), NULL, 10);
+    }
+
+    std::string name() {
+        char hash[32];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)fnv1a(key + " version=" CODE_VERSION));
+        return mode + "_T" + std::to_string((long)t) + "_A" + std::to_string(a) + "_N" + std::to_string(n) + "_" + hash;
+    }
+};
+
+std::string hostName() {
+    char name[256] = {0};
+    gethostname(name, sizeof(name) - 1);
+    return name;
+}
+
+bool readResult(std::string path, Result &result) {
+    std::ifstream in(path);
+    double t;
+    return (bool)(in >> t >> result.a >> result.n >> result.efficiency >> result.throughput >> result.delay);
+}
+
+void writeResult(std::string path, Result result) {
+    std::string tmp = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(tmp, std::ofstream::out | std::ofstream::trunc);
+    out.precision(17);
+    out << T << " " << result.a << " " << result.n << " " << result.efficiency << " " << result.throughput << " " << result.delay << std::endl;
+    out.close();
+    rename(tmp.c_str(), path.c_str());
+}
+
+bool claim(std::string path) {
+    int fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) { return false; }
+    std::string owner = hostName() + " " + std::to_string(getpid()) + "\n";
+    write(fd, owner.c_str(), owner.size());
+    close(fd);
+    return true;
+}
+
+const int CLAIM_LEASE = 120;
+
+// Drops claims left behind by dead workers on this host and claims whose
+// lease has run out on any host
+void releaseStaleClaim(std::string path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) { return; }
+    std::ifstream in(path);
+    std::string host;
+    int pid;
+    bool dead = in >> host >> pid && host == hostName() && kill(pid, 0) != 0;
+    if (dead || time(NULL) - info.st_mtime > CLAIM_LEASE) {
+        unlink(path.c_str());
+    }
+}
+
+// Keeps a claim's lease alive for as long as it is in scope
+class ClaimLease {
+public:
+    std::string path;
+    std::mutex lock;
+    std::condition_variable stop;
+    bool done;
+    std::thread heartbeat;
+
+    ClaimLease(std::string t_path) {
+        path = t_path;
+        done = false;
+        heartbeat = std::thread([this]() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (!stop.wait_for(guard, std::chrono::seconds(CLAIM_LEASE / 4), [this]() { return done; })) {
+                utimes(path.c_str(), NULL);
+            }
+        });
+    }
+
+    ~ClaimLease() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done = true;
+        }
+        stop.notify_one();
+        heartbeat.join();
+    }
+};
+
+void runShards(std::string dir, std::vector<SweepPoint> points) {
+    for (auto point: points) {
+        std::string base = dir + "/" + point.name();
+        Result result(0, 0);
+        if (readResult(base + ".result", result)) { continue; }
+        if (!applyPointKey(point.key)) {
+            std::cerr << "Cannot run " << point.name() << " here, its trace is missing or has changed" << std::endl;
+            continue;
+        }
+        releaseStaleClaim(base + ".claim");
+        if (!claim(base + ".claim")) { continue; }
+
+        {
+            ClaimLease lease(base + ".claim");
+            transmitted = 0;
+            transmissionAttempts = 0;
+            writeResult(base + ".result", createSimulation(point.a, point.n));
+        }
+        unlink((base + ".claim").c_str());
+    }
+}
+
+void writePending(std::string dir, std::vector<SweepPoint> points) {
+    std::string tmp = dir + "/pending.tmp";
+    std::ofstream out(tmp, std::ofstream::out | std::ofstream::trunc);
+    for (auto point: points) {
+        out << point.key << std::endl;
+    }
+    out.close();
+    rename(tmp.c_str(), (dir + "/pending").c_str());
+}
+
+std::vector<SweepPoint> readPending(std::string dir) {
+    std::vector<SweepPoint> points;
+    std::ifstream in(dir + "/pending");
+    std::string key;
+    while (std::getline(in, key)) {
+        if (!key.empty()) { points.push_back(SweepPoint(key)); }
+    }
+    return points;
+}
+
+// Runs one sweep round over `workers` forked processes plus any remote workers
+// attached to `dir`, and returns the merged results in grid order.
+std::vector<Result> runRound(std::string dir, std::vector<SweepPoint> points, int workers) {
+    writePending(dir, points);
+
+    std::vector<pid_t> children;
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            std::cerr << "Cannot fork worker " << i << ", running its shards here" << std::endl;
+            break;
+        }
+        if (pid == 0) {
+            generator.seed(std::chrono::system_clock::now().time_since_epoch().count() ^ getpid());
+            runShards(dir, points);
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    for (auto pid: children) {
+        waitpid(pid, NULL, 0);
+    }
+
+    // Pick up shards whose worker died or whose lease ran out, and wait for
+    // remote workers
+    std::vector<Result> results;
+    for (auto point: points) {
+        std::string base = dir + "/" + point.name();
+        Result result(0, 0);
+        while (!readResult(base + ".result", result)) {
+            runShards(dir, {point});
+            if (!readResult(base + ".result", result)) { sleep(1); }
+        }
+        results.push_back(result);
+    }
+    return results;
+}
+
+int shardedSim(std::string fileName, int workers, std::string dir) {
+    std::vector<int> A = sweepLoads();
+    std::vector<int> N {20, 40, 60, 80, 100};
+
+    auto prev = Result(0, 0);
+    if (traceFile) { T = traceFile->duration; }
+    while(1) {
+        std::vector<SweepPoint> points;
+        for (auto a: A) {
+            for (auto n: N) {
+                points.push_back(SweepPoint(pointKey(a, n)));
+            }
+        }
+
+        double roundT = T;
+        auto results = runRound(dir, points, workers);
+        T = roundT;
+
+        auto result = results.back();
+        if (isStable(prev, result) || traceFile) {
+            write(results, fileName);
+            std::cout << "Stable" << std::endl;
+            return 0;
+        }
+        prev = result;
+        T += 1000;
+        std::cout << "Unstable" << std::endl;
+    }
+}
+
+// Remote worker: serves pending shards in `dir` until the sweep is done
+int worker(std::string dir) {
+    while (access((dir + "/done").c_str(), F_OK) != 0) {
+        runShards(dir, readPending(dir));
+        sleep(1);
+    }
+    return 0;
+}
+
+// Times every persistence policy on the same traffic
+int benchmark() {
+    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+    std::vector<std::pair<int, int>> points {{7, 20}, {20, 100}, {10, 1000}};
+    for (auto p: {PERSISTENT, NON_PERSISTENT, P_PERSISTENT}) {
+        persistence = p;
+        for (auto point: points) {
+            generator.seed(seed);
+            auto start = std::chrono::steady_clock::now();
+            createSimulation(point.first, point.second);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << persistenceName(p) << " " << point.first << " " << point.second << ": " << elapsed.count() << "s, "
+                      << transmissionAttempts / elapsed.count() << " attempts/s" << std::endl;
+        }
+    }
+    return 0;
+}
+
+// Compares the mean-field engine against exact runs at the lab's grid points
+// and flags the points it misses by more than MEAN_FIELD_TOLERANCE
+int calibrate() {
+    std::vector<int> A {7, 10, 20};
+    std::vector<int> N {20, 40, 60, 80, 100};
+    double worst = 0;
+    int flagged = 0;
+    // Every point is reported below
+    meanFieldWarned = true;
+    for (auto a: A) {
+        for (auto n: N) {
+            meanFieldEngine = false;
+            auto exact = createSimulation(a, n);
+
+            auto start = std::chrono::steady_clock::now();
+            meanFieldEngine = true;
+            auto approx = createSimulation(a, n);
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+            double efficiencyError = fabs(approx.efficiency - exact.efficiency);
+            double throughputError = fabs(approx.throughput - exact.throughput);
+            worst = std::max(worst, std::max(efficiencyError, throughputError));
+            bool over = std::max(efficiencyError, throughputError) > MEAN_FIELD_TOLERANCE;
+            flagged += over;
+            std::cout << "A=" << a << " N=" << n << " load " << offeredLoad(a, n) << " efficiency error " << efficiencyError
+                      << ", throughput error " << throughputError << ", " << elapsed.count() << "ms"
+                      << (over ? " OVER TOLERANCE" : "") << std::endl;
+        }
+    }
+    std::cout << "worst absolute error " << worst << ", " << flagged << " points over " << MEAN_FIELD_TOLERANCE << std::endl;
+    return 0;
+}
+
+// Two-sided 95% Student t quantile
+double studentT95(int df) {
+    static const double table[] {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+                                 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+                                 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    return df <= 30 ? table[std::max(df, 1) - 1] : 1.96 + 2.4 / df;
+}
+
+// Mean and 95% half width of paired differences, and the half width the same
+// runs would give if the protocols had seen independent traffic
+void pairedInterval(std::vector<double> &base, std::vector<double> &other, double &mean, double &paired, double &unpaired) {
+    int r = base.size();
+    double baseMean = 0, otherMean = 0;
+    for (int i = 0; i < r; i++) {
+        baseMean += base[i] / r;
+        otherMean += other[i] / r;
+    }
+    double diffVar = 0, baseVar = 0, otherVar = 0;
+    for (int i = 0; i < r; i++) {
+        double diff = other[i] - base[i] - (otherMean - baseMean);
+        diffVar += diff * diff / (r - 1);
+        baseVar += (base[i] - baseMean) * (base[i] - baseMean) / (r - 1);
+        otherVar += (other[i] - otherMean) * (other[i] - otherMean) / (r - 1);
+    }
+    mean = otherMean - baseMean;
+    paired = studentT95(r - 1) * sqrt(diffVar / r);
+    unpaired = studentT95(r - 1) * sqrt((baseVar + otherVar) / r);
+}
+
+// Common random numbers: every protocol replays replication r of a point
+// from the same seed, so each node sees the same arrivals and draws backoffs
+// from the same stream. The paired differences then cancel most of the
+// traffic noise.
+int pairedComparison(std::vector<std::string> protocols, int replications) {
+    if (protocols.size() < 2 || replications < 2) {
+        std::cerr << "paired needs two protocols and at least two replications" << std::endl;
+        return 1;
+    }
+    uint64_t base = seeded ? seed : std::chrono::system_clock::now().time_since_epoch().count();
+    std::vector<int> A = sweepLoads();
+    std::vector<int> N {20, 40, 60, 80, 100};
+
+    for (auto a: A) {
+        for (auto n: N) {
+            std::vector<std::vector<double>> efficiency(protocols.size()), throughput(protocols.size());
+            for (int r = 0; r < replications; r++) {
+                uint64_t replicationSeed = fnv1a(std::to_string(base) + " " + std::to_string(a) + " " + std::to_string(n) + " " + std::to_string(r));
+                for (int i = 0; i < (int)protocols.size(); i++) {
+                    persistence = parsePersistence(protocols[i]);
+                    generator.seed(replicationSeed);
+                    auto result = simulatePoint(a, n);
+                    efficiency[i].push_back(result.efficiency);
+                    throughput[i].push_back(result.throughput);
+                }
+            }
+
+            for (int i = 1; i < (int)protocols.size(); i++) {
+                double mean, paired, unpaired;
+                std::cout << "A=" << a << " N=" << n << " " << protocols[i] << " - " << protocols[0];
+                pairedInterval(efficiency[0], efficiency[i], mean, paired, unpaired);
+                std::cout << ": efficiency " << mean << " +- " << paired << " (independent +- " << unpaired << ")";
+                pairedInterval(throughput[0], throughput[i], mean, paired, unpaired);
+                std::cout << ", throughput " << mean << " +- " << paired << " (independent +- " << unpaired << ")" << std::endl;
+            }
+        }
+    }
+    return 0;
+}
+
+// Simulation server
+//
+// serve <socket> [threads] listens on a Unix domain socket. Clients send one
+// job per line as key=value pairs, e.g. "id=7 mode=Npersistent A=10 N=60
+// T=500 seed=1", and get one line back per job, tagged with its id, as soon as
+// it finishes, so the results of a batch may arrive out of order. The worker
+// threads stay up between jobs, each with its own generator and settings;
+// every job starts from the options the server was started with. Bad jobs are
+// answered with an error="..." field and never stop the server.
+//
+// Jobs are capped at MAX_JOB_NODES nodes. Nodes take about 4KB each with
+// their telemetry, so a job at the cap needs about 400MB.
+const int MAX_JOB_NODES = 100000;
+
+class Connection {
+public:
+    int fd;
+    std::mutex lock;
+
+    Connection(int t_fd) {
+        fd = t_fd;
+    }
+
+    ~Connection() {
+        close(fd);
+    }
+
+    void reply(std::string line) {
+        std::lock_guard<std::mutex> guard(lock);
+        line += "\n";
+        for (size_t sent = 0; sent < line.size(); ) {
+            ssize_t n = send(fd, line.c_str() + sent, line.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) { return; }
+            sent += n;
+        }
+    }
+};
+
+class Job {
+public:
+    std::shared_ptr<Connection> connection;
+    std::string spec;
+};
+
+class JobQueue {
+public:
+    std::mutex lock;
+    std::condition_variable ready;
+    std::deque<Job> jobs;
+
+    void push(Job job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            jobs.push_back(job);
+        }
+        ready.notify_one();
+    }
+
+    Job pop() {
+        std::unique_lock<std::mutex> guard(lock);
+        ready.wait(guard, [this]() { return jobs.size() > 0; });
+        Job job = jobs.front();
+        jobs.pop_front();
+        return job;
+    }
+};
+
+std::string runJob(std::string spec) {
+    std::istringstream words(spec);
+    std::string word, id, error;
+    int a = 7, n = 20;
+    while (words >> word) {
+        size_t eq = word.find('=');
+        std::string key = word.substr(0, eq);
+        std::string value = eq == std::string::npos ? "" : word.substr(eq + 1);
+        if (key == "id") { id = value; }
+        else if (key == "A") { a = strtol(value.c_str(), NULL, 10); }
+        else if (key == "N") { n = strtol(value.c_str(), NULL, 10); }
+        else if (key == "mode" && !isPersistence(value)) { error = "unknown mode " + value; }
+        else if (key == "engine" && value != "des" && value != "meanfield") { error = "unknown engine " + value; }
+        else if (!applyOption(key, value)) { error = "unknown key " + key; }
+    }
+    if (error.empty() && (a <= 0 || n <= 0 || T <= 0 || persistenceP <= 0 || persistenceP > 1)) {
+        error = "bad parameters";
+    }
+    if (error.empty() && n > MAX_JOB_NODES) {
+        error = "N is limited to " + std::to_string(MAX_JOB_NODES);
+    }
+    if (error.empty()) {
+        Topology::check(topologySpec, n, error);
+    }
+    if (error.empty() && traceFile && meanFieldEngine) {
+        error = "the mean-field engine cannot replay a trace";
+    }
+
+    std::ostringstream out;
+    out.precision(17);
+    out << "id=" << id;
+    if (!error.empty()) {
+        out << " error=\"" << error << "\"";
+        return out.str();
+    }
+    Result result = runPoint(a, n);
+    out << " mode=" << persistenceName(persistence) << " A=" << result.a << " N=" << result.n << " T=" << T
+        << " efficiency=" << result.efficiency << " throughput=" << result.throughput << " delay=" << result.delay;
+    return out.str();
+}
+
+int serve(std::string path, int threads) {
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Cannot listen on " << path << std::endl;
+        return 1;
+    }
+
+    // The server's own options are every job's defaults
+    double defaultT = T;
+    Persistence defaultPersistence = persistence;
+    double defaultP = persistenceP;
+    std::string defaultTopology = topologySpec;
+    bool defaultMeanField = meanFieldEngine;
+    bool defaultSeeded = seeded;
+    uint64_t defaultSeed = seed;
+
+    JobQueue queue;
+    for (int i = 0; i < threads; i++) {
+        std::thread([&queue, i, defaultT, defaultPersistence, defaultP, defaultTopology, defaultMeanField, defaultSeeded, defaultSeed]() {
+            generator.seed(std::chrono::system_clock::now().time_since_epoch().count() + i);
+            while (true) {
+                Job job = queue.pop();
+                T = defaultT;
+                persistence = defaultPersistence;
+                persistenceP = defaultP;
+                topologySpec = defaultTopology;
+                meanFieldEngine = defaultMeanField;
+                seeded = defaultSeeded;
+                seed = defaultSeed;
+                job.connection->reply(runJob(job.spec));
+            }
+        }).detach();
+    }
+    std::cerr << "Serving on " << path << " with " << threads << " workers" << std::endl;
+
+    while (true) {
+        int fd = accept(listener, NULL, NULL);
+        if (fd < 0) { continue; }
+        auto connection = std::make_shared<Connection>(fd);
+        std::thread([connection, &queue]() {
+            std::string pending;
+            char buffer[4096];
+            ssize_t n;
+            while ((n = read(connection->fd, buffer, sizeof(buffer))) > 0) {
+                pending.append(buffer, n);
+                size_t end;
+                while ((end = pending.find('\n')) != std::string::npos) {
+                    std::string line = pending.substr(0, end);
+                    pending.erase(0, end + 1);
+                    if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                        queue.push(Job {connection, line});
+                    }
+                }
+            }
+            // The connection closes once its last job has replied
+        }).detach();
+    }
 }
 
+int main(int argc, char* argv[]) {
+    // Options are given as key=value anywhere on the command line
+    std::vector<std::string> args;
+    std::vector<std::string> protocols {"persistent", "Npersistent"};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("topology=", 0) == 0) {
+            topologySpec = arg.substr(9);
+            std::string error;
+            if (!Topology::check(topologySpec, 1, error)) {
+                std::cerr << error << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("p=", 0) == 0) {
+            persistenceP = strtod(arg.substr(2).c_str(), NULL);
+            if (persistenceP <= 0 || persistenceP > 1) {
+                std::cerr << "p must be in (0, 1]" << std::endl;
+                return 1;
+            }
+            protocols.push_back("Ppersistent");
+        } else if (arg.rfind("protocol=", 0) == 0) {
+            if (!isPersistence(arg.substr(9))) {
+                std::cerr << "unknown protocol " << arg.substr(9) << std::endl;
+                return 1;
+            }
+            persistence = parsePersistence(arg.substr(9));
+            protocols = {persistenceName(persistence)};
+        } else if (arg == "engine=meanfield") {
+            meanFieldEngine = true;
+        } else if (arg.rfind("seed=", 0) == 0) {
+            seeded = true;
+            seed = strtoull(arg.substr(5).c_str(), NULL, 10);
+        } else if (arg.rfind("cache=", 0) == 0) {
+            cacheDir = arg.substr(6);
+        } else if (arg.rfind("trace=", 0) == 0) {
+            traceFile = new TraceFile(arg.substr(6));
+            if (!traceFile->valid()) {
+                std::cerr << "Cannot read trace " << traceFile->path << std::endl;
+                return 1;
+            }
+        } else if (arg.rfind("report=", 0) == 0) {
+            reportDir = arg.substr(7);
+            mkdir(reportDir.c_str(), 0755);
+        } else {
+            args.push_back(arg);
+        }
+    }
+    argc = args.size() + 1;
+    for (int i = 1; i < argc; i++) {
+        argv[i] = (char *)args[i - 1].c_str();
+    }
+
+    std::string mode = argc > 1 ? argv[1] : "";
+    // The mean-field engine has no nodes to replay a trace into
+    if (traceFile && (meanFieldEngine || mode == "calibrate")) {
+        std::cerr << "The mean-field engine cannot replay a trace" << std::endl;
+        return 1;
+    }
+    // Timing modes rerun the same point, so they never read the cache
+    if (mode == "calibrate" || mode == "bench") {
+        cacheDir.clear();
+    }
+    if (seeded && !cacheDir.empty()) {
+        mkdir(cacheDir.c_str(), 0755);
+    }
+    if (mode == "convert" && argc > 3) {
+        return convertTrace(argv[2], argv[3]);
+    }
+    if (mode == "serve" && argc > 2) {
+        return serve(argv[2], argc > 3 ? strtol(argv[3], NULL, 10) : std::thread::hardware_concurrency());
+    }
+    if (mode == "worker" && argc > 2) {
+        return worker(argv[2]);
+    }
+    if (mode == "paired" && argc > 2) {
+        if (argc > 3) { T = strtod(argv[3], NULL); }
+        return pairedComparison(protocols, strtol(argv[2], NULL, 10));
+    }
+    if (mode == "calibrate") {
+        if (argc > 2) { T = strtod(argv[2], NULL); }
+        return calibrate();
+    }
+    if (mode == "bench") {
+        if (argc > 2) { T = strtod(argv[2], NULL); }
+        return benchmark();
+    }
+
+    int workers = 0;
+    std::string dir;
+    if (mode == "sweep" && argc > 3) {
+        workers = strtol(argv[2], NULL, 10);
+        dir = argv[3];
+        mkdir(dir.c_str(), 0755);
+        unlink((dir + "/done").c_str());
+    }
+
+    for (auto protocol: protocols) {
+        clear(protocol + "Ef");
+        clear(protocol + "Th");
+    }
+
+    for (auto protocol: protocols) {
+        persistence = parsePersistence(protocol);
+        if (dir.empty()) {
+            sim(protocol);
+        } else {
+            shardedSim(protocol, workers, dir);
+        }
+    }
+    if (!dir.empty()) {
+        std::ofstream(dir + "/done").close();
+    }
+}
 